@@ -0,0 +1,111 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+// A tiny harness shared by the benchmarks. A benchmark runs a number of
+// rounds, each of which does some operations and is timed as a whole, and
+// reports one JSON object per line with the ns/op over all the rounds and
+// the percentiles of the ns/op of the rounds, e.g.
+//
+//   {"bench":"timer_add","impl":"heap","backend":"epoll","n":1000,
+//    "ops":100000,"ns_op":41.2,"p50":40.1,"p90":44.0,"p99":52.3,
+//    "p999":60.8}
+//
+// so that runs can be compared across commits, or across backends picked
+// by $LIBX_BACKEND, with any JSON tool.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "x/ev.h"
+
+struct bench {
+  const char *name;
+  const char *impl;
+  long long n;         // the size of the benchmark, e.g. the number of fds.
+  long long ops;       // the number of operations done.
+  long long ns;        // the time spent on them.
+  double *samples;     // ns/op of each round.
+  int len;
+  int cap;
+};
+
+static inline long long bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void bench_init(struct bench *b, const char *name,
+                              const char *impl, long long n) {
+  memset(b, 0, sizeof(*b));
+  b->name = name;
+  b->impl = impl;
+  b->n = n;
+}
+
+// bench_round records a round of 'ops' operations which took 'ns'.
+static inline void bench_round(struct bench *b, long long ns, long long ops) {
+  if (ops <= 0)
+    return;
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 1024;
+    b->samples = realloc(b->samples, sizeof(double) * b->cap);
+    if (!b->samples) {
+      perror("bench_round");
+      exit(1);
+    }
+  }
+  b->samples[b->len++] = (double)ns / ops;
+  b->ns += ns;
+  b->ops += ops;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static inline double bench_pct(struct bench *b, double p) {
+  int i = (int)(p * (b->len - 1) + 0.5);
+  return b->samples[i];
+}
+
+// bench_backend returns the name of the backend event loops pick.
+static inline const char *bench_backend(void) {
+  static char name[16];
+  struct loop *L;
+  if (!name[0] && (L = loop_alloc(1)) != NULL) {
+    snprintf(name, sizeof(name), "%s", loop_backend(L));
+    loop_free(L);
+  }
+  return name;
+}
+
+// bench_report prints the result of a benchmark and frees its samples.
+static inline void bench_report(struct bench *b) {
+  if (!b->len)
+    return;
+  qsort(b->samples, b->len, sizeof(double), bench_cmp);
+  printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"backend\":\"%s\","
+         "\"n\":%lld,\"ops\":%lld,\"ns_op\":%.1f,\"p50\":%.1f,"
+         "\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f}\n",
+         b->name, b->impl, bench_backend(), b->n, b->ops,
+         (double)b->ns / b->ops,
+         bench_pct(b, 0.5), bench_pct(b, 0.9), bench_pct(b, 0.99),
+         bench_pct(b, 0.999));
+  fflush(stdout);
+  free(b->samples);
+  b->samples = NULL;
+}
+
+// bench_scale returns the environment variable BENCH_SCALE, which scales
+// down the sizes of the benchmarks for quick runs, e.g. BENCH_SCALE=10.
+static inline int bench_scale(void) {
+  const char *s = getenv("BENCH_SCALE");
+  int n = s ? atoi(s) : 1;
+  return n > 0 ? n : 1;
+}
+
+#endif  // _BENCH_H
@@ -0,0 +1,115 @@
+// Footprint of connections: the bytes a connection costs, a struct ev
+// along with what the event loop keeps for its fd, with as many of them
+// as the limit of open files allows up to 1M, the time to dispatch them,
+// and what struct ev saves over its layout with a struct timeval per 1M
+// connections.
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+// struct ev_timeval is struct ev as it was with a struct timeval deadline.
+struct ev_timeval {
+  int fd;
+  int events;
+  long long ms;
+  int (*callback)(struct loop *, struct ev *);
+  void *ud;
+  struct timeval when;
+  int id;
+  int revents;
+};
+
+static int fired;
+
+static int on_read(struct loop *L, struct ev *ev) {
+  fired++;
+  return 0;
+}
+
+// rss returns the resident set size in bytes, ru_maxrss won't do since
+// it may count the process before exec.
+static long long rss(void) {
+  long long size, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%lld %lld", &size, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// bench_conn watches n dups of a readable socket, like n connections
+// each embedding a struct ev.
+static void bench_conn(int n) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  long long base, t0;
+  int i, k, sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      write(sv[1], "x", 1) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  base = rss();
+  L = loop_alloc(n);
+  evs = calloc(n, sizeof(*evs));
+  if (!L || !evs) {
+    perror("bench_conn");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if ((evs[i].fd = dup(sv[0])) < 0) {
+      perror("dup");
+      exit(1);
+    }
+    evs[i].events = EV_READ;
+    evs[i].callback = on_read;
+    loop_add(L, &evs[i]);
+  }
+  fired = 0;
+  loop_dispatch(L, EV_IO);  // registers them all.
+  printf("{\"bench\":\"conn_footprint\",\"impl\":\"ev\",\"backend\":\"%s\","
+         "\"n\":%d,\"sizeof\":%d,\"sizeof_timeval\":%d,\"bytes_conn\":%.1f,"
+         "\"saved_1m\":%lld}\n",
+         loop_backend(L), n, (int)sizeof(struct ev),
+         (int)sizeof(struct ev_timeval), (double)(rss() - base) / n,
+         (long long)(sizeof(struct ev_timeval) - sizeof(struct ev)) * 1000000);
+  fflush(stdout);
+
+  bench_init(&b, "conn_dispatch", "ev", n);
+  for (k = 0; k < 20; k++) {
+    fired = 0;
+    t0 = bench_now();
+    loop_dispatch(L, EV_IO);
+    bench_round(&b, bench_now() - t0, fired);
+  }
+  bench_report(&b);
+
+  loop_free(L);
+  for (i = 0; i < n; i++)
+    close(evs[i].fd);
+  free(evs);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(void) {
+  struct rlimit rl;
+  int n = 1000000 / bench_scale();
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur != RLIM_INFINITY && n > (long long)rl.rlim_cur - 64)
+    n = (int)rl.rlim_cur - 64;
+  bench_conn(n);
+  return 0;
+}
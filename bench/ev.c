@@ -0,0 +1,72 @@
+// Footprint of events: the bytes a registered timer event costs, struct ev
+// along with its slot in the minheap, and the time to dispatch them all,
+// at 1M events.
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+static int fired;
+
+static int on_timer(struct loop *L, struct ev *ev) {
+  fired++;
+  return 0;
+}
+
+// maxrss returns the peak resident set size in bytes.
+static long long maxrss(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss;
+#else
+  return ru.ru_maxrss * 1024LL;
+#endif
+}
+
+static void bench_footprint(int n) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  long long rss, t0;
+  int i, last;
+
+  rss = maxrss();
+  L = loop_alloc(1);
+  evs = calloc(n, sizeof(*evs));
+  if (!L || !evs) {
+    perror("bench_footprint");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    evs[i].fd = -1;
+    evs[i].events = EV_TIMER;
+    evs[i].ms = 1;
+    evs[i].callback = on_timer;
+    loop_add(L, &evs[i]);
+  }
+  printf("{\"bench\":\"ev_footprint\",\"impl\":\"%s\",\"n\":%d,"
+         "\"sizeof\":%d,\"bytes_ev\":%.1f}\n",
+         "heap", n, (int)sizeof(struct ev), (double)(maxrss() - rss) / n);
+
+  usleep(2000);
+  bench_init(&b, "ev_dispatch", "heap", n);
+  fired = 0;
+  while (fired < n) {
+    last = fired;
+    t0 = bench_now();
+    loop_dispatch(L, EV_TIMER);
+    bench_round(&b, bench_now() - t0, fired - last);
+  }
+  bench_report(&b);
+
+  loop_free(L);
+  free(evs);
+}
+
+int main(void) {
+  bench_footprint(1000000 / bench_scale());
+  return 0;
+}
@@ -0,0 +1,179 @@
+// Fan-in throughput: n sockets become readable at once and are drained
+// through loop_dispatch, which is what a server does under load, and a
+// trickle of bytes over n sockets is drained with and without batching
+// polls, which is what a relay does under a steady load.
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+static int drained;
+
+static int on_read(struct loop *L, struct ev *ev) {
+  char buf[64];
+  if (read(ev->fd, buf, sizeof(buf)) > 0)
+    drained++;
+  return 0;
+}
+
+static void bench_fanin(int n) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  int *peers, i, k, repeat, sv[2];
+  long long t0;
+
+  L = loop_alloc(n);
+  evs = calloc(n, sizeof(*evs));
+  peers = malloc(sizeof(int) * n);
+  if (!L || !evs || !peers) {
+    perror("bench_fanin");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    peers[i] = sv[1];
+    evs[i].fd = sv[0];
+    evs[i].events = EV_READ;
+    evs[i].callback = on_read;
+    loop_add(L, &evs[i]);
+  }
+
+  bench_init(&b, "fanin", "read", n);
+  repeat = 200000 / n + 1;
+  for (k = 0; k < repeat; k++) {
+    for (i = 0; i < n; i++)
+      write(peers[i], "x", 1);
+    drained = 0;
+    t0 = bench_now();
+    while (drained < n)
+      loop_dispatch(L, EV_READ);
+    bench_round(&b, bench_now() - t0, n);
+  }
+  bench_report(&b);
+
+  for (i = 0; i < n; i++) {
+    loop_del(L, &evs[i]);
+    close(evs[i].fd);
+    close(peers[i]);
+  }
+  loop_free(L);
+  free(evs);
+  free(peers);
+}
+
+#define TRICKLE 100000  // bytes written by bench_trickle.
+
+static int on_drain(struct loop *L, struct ev *ev) {
+  char buf[64];
+  ssize_t n = read(ev->fd, buf, sizeof(buf));
+  if (n > 0)
+    drained += n;
+  return 0;
+}
+
+struct trickle {
+  int *peers;
+  int n;
+};
+
+// spray writes a byte to each of the sockets in turn every 5 microseconds.
+static void *spray(void *arg) {
+  struct trickle *tr = arg;
+  long long t = bench_now();
+  int i;
+  for (i = 0; i < TRICKLE; i++) {
+    while (bench_now() < t)
+      ;
+    write(tr->peers[i % tr->n], "x", 1);
+    t += 5000;
+  }
+  return NULL;
+}
+
+// bench_trickle drains bytes written at a steady rate over n sockets and
+// reports the CPU time of the loop per byte, with LOOP_OPT_BATCH set to
+// 'batch'.
+static void bench_trickle(int n, int batch) {
+  struct bench b;
+  struct trickle tr;
+  struct loop *L;
+  struct ev *evs;
+  struct timespec ts;
+  pthread_t tid;
+  int i, last, sv[2];
+  long long t0, t1;
+
+  L = loop_alloc(n);
+  evs = calloc(n, sizeof(*evs));
+  tr.peers = malloc(sizeof(int) * n);
+  tr.n = n;
+  if (!L || !evs || !tr.peers) {
+    perror("bench_trickle");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    tr.peers[i] = sv[1];
+    evs[i].fd = sv[0];
+    evs[i].events = EV_READ;
+    evs[i].callback = on_drain;
+    loop_add(L, &evs[i]);
+  }
+  loop_setopt(L, LOOP_OPT_BATCH, batch);
+
+  bench_init(&b, "trickle", batch ? "batch" : "nobatch", n);
+  drained = 0;
+  pthread_create(&tid, NULL, spray, &tr);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  t0 = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  while (drained < TRICKLE) {
+    last = drained;
+    loop_dispatch(L, EV_READ);
+    if (drained == last)
+      continue;  // counted with the next round.
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    t1 = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    bench_round(&b, t1 - t0, drained - last);
+    t0 = t1;
+  }
+  pthread_join(tid, NULL);
+  bench_report(&b);
+
+  for (i = 0; i < n; i++) {
+    loop_del(L, &evs[i]);
+    close(evs[i].fd);
+    close(tr.peers[i]);
+  }
+  loop_free(L);
+  free(evs);
+  free(tr.peers);
+}
+
+int main(void) {
+  struct rlimit rl;
+  int n, scale = bench_scale();
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  for (n = 16; n <= 16384 && n / scale > 0; n *= 8) {
+    if (n * 2 + 64 > rl.rlim_cur)
+      break;
+    bench_fanin(n / scale);
+  }
+  bench_trickle(16, 0);
+  bench_trickle(16, 16);
+  return 0;
+}
@@ -0,0 +1,75 @@
+// IO event churn: adding and deleting IO events of n sockets, with and
+// without a poll in between.
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+static int on_io(struct loop *L, struct ev *ev) { return 0; }
+
+// bench_churn adds IO events watching n sockets for EV_WRITE, which are
+// always ready, and deletes them, dispatching them in between if 'poll'
+// is set, or else the additions are folded away by the change list.
+static void bench_churn(int n, int poll) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  int i, k, repeat, sv[2];
+  long long t0;
+
+  L = loop_alloc(n);
+  evs = calloc(n, sizeof(*evs));
+  if (!L || !evs) {
+    perror("bench_churn");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    close(sv[1]);
+    evs[i].fd = sv[0];
+    evs[i].events = EV_WRITE;
+    evs[i].callback = on_io;
+  }
+
+  bench_init(&b, "fd_churn", poll ? "polled" : "folded", n);
+  repeat = 100000 / n + 1;
+  for (k = 0; k < repeat; k++) {
+    t0 = bench_now();
+    for (i = 0; i < n; i++)
+      loop_add(L, &evs[i]);
+    if (poll)
+      loop_dispatch(L, EV_WRITE);
+    for (i = 0; i < n; i++)
+      loop_del(L, &evs[i]);
+    bench_round(&b, bench_now() - t0, n);
+  }
+  bench_report(&b);
+
+  for (i = 0; i < n; i++)
+    close(evs[i].fd);
+  loop_free(L);
+  free(evs);
+}
+
+int main(void) {
+  struct rlimit rl;
+  int n, scale = bench_scale();
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  for (n = 16; n <= 16384 && n / scale > 0; n *= 8) {
+    if (n * 2 + 64 > rl.rlim_cur)
+      break;
+    bench_churn(n / scale, 0);
+    bench_churn(n / scale, 1);
+  }
+  return 0;
+}
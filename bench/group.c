@@ -0,0 +1,150 @@
+// Thread scaling of a loop group: connections per second to a server of
+// 1..N event loops, each with its own listener on the same port by
+// NET_REUSEPORT so that the kernel spreads connections across them, with
+// N the number of CPUs but at least 4. Each connection sends a byte,
+// reads it back and closes, from as many client threads as CPUs.
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+#include "x/mm.h"
+#include "x/net.h"
+
+#define MAX_THREADS 64
+#define ROUNDS      20
+
+struct server {
+  struct ev ev;  // the listener.
+  int conns;     // connections accepted.
+};
+
+static struct server servers[MAX_THREADS];
+static unsigned short port;
+static int conns_per_client;
+
+static int on_echo(struct loop *L, struct ev *ev) {
+  char c;
+  if (read(ev->fd, &c, 1) == 1 && write(ev->fd, &c, 1) == 1)
+    return 0;
+  loop_del(L, ev);
+  close(ev->fd);
+  free(ev);
+  return 0;
+}
+
+static int on_accept(struct loop *L, struct ev *ev) {
+  struct server *s = container_of(ev, struct server, ev);
+  struct ev *conn;
+  int fd;
+
+  if ((fd = accept(ev->fd, NULL, NULL)) < 0)
+    return 0;
+  if (!(conn = calloc(1, sizeof(*conn)))) {
+    close(fd);
+    return 0;
+  }
+  conn->fd = fd;
+  conn->events = EV_READ;
+  conn->callback = on_echo;
+  s->conns++;
+  return loop_add(L, conn);
+}
+
+static int init(struct loop *L, int i, void *ud) {
+  struct server *s = &servers[i];
+  memset(s, 0, sizeof(*s));
+  if ((s->ev.fd = tcp_listen_flags("127.0.0.1", port, NET_REUSEPORT)) < 0)
+    return -1;
+  s->ev.events = EV_READ;
+  s->ev.callback = on_accept;
+  return loop_add(L, &s->ev);
+}
+
+// client connects, sends a byte, reads it back and closes, over and over.
+static void *client(void *arg) {
+  struct sockaddr_in sa = {0};
+  int i, fd;
+  char c = 'x';
+
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (i = 0; i < conns_per_client; i++) {
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      break;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        write(fd, &c, 1) != 1 || read(fd, &c, 1) != 1) {
+      close(fd);
+      break;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+// free_port returns a port on the loopback nobody listens on.
+static unsigned short free_port(void) {
+  struct sockaddr_in sa = {0};
+  socklen_t len = sizeof(sa);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+      getsockname(fd, (struct sockaddr *)&sa, &len) < 0) {
+    perror("free_port");
+    exit(1);
+  }
+  close(fd);
+  return ntohs(sa.sin_port);
+}
+
+static void bench_group(int nthreads, int nclients) {
+  pthread_t tids[MAX_THREADS];
+  struct bench b;
+  struct group *g;
+  char impl[16];
+  long long t0;
+  int i, k;
+
+  port = free_port();
+  if (!(g = group_alloc(nthreads, 64, 0)) ||
+      group_start(g, init, NULL) < 0) {
+    perror("bench_group");
+    exit(1);
+  }
+  usleep(10000);  // the listeners are opened by the threads.
+  snprintf(impl, sizeof(impl), "%d", nthreads);
+  bench_init(&b, "group_accept", impl, nthreads);
+  for (k = 0; k < ROUNDS; k++) {
+    t0 = bench_now();
+    for (i = 0; i < nclients; i++)
+      pthread_create(&tids[i], NULL, client, NULL);
+    for (i = 0; i < nclients; i++)
+      pthread_join(tids[i], NULL);
+    bench_round(&b, bench_now() - t0, (long long)nclients * conns_per_client);
+  }
+  bench_report(&b);
+
+  group_stop(g);
+  group_join(g);
+  for (i = 0; i < nthreads; i++)
+    close(servers[i].ev.fd);
+  group_free(g);
+}
+
+int main(void) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int n, max, nclients;
+
+  max = ncpu < 4 ? 4 : ncpu > MAX_THREADS ? MAX_THREADS : (int)ncpu;
+  nclients = ncpu < 2 ? 2 : ncpu > MAX_THREADS ? MAX_THREADS : (int)ncpu;
+  conns_per_client = 1000 / bench_scale() / nclients + 1;
+  for (n = 1; n <= max; n *= 2)
+    bench_group(n, nclients);
+  return 0;
+}
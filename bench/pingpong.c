@@ -0,0 +1,92 @@
+// Ping-pong latency: round trips of a byte over a socketpair through
+// loop_dispatch, between two IO events of the same loop, and between a
+// loop and a thread echoing with blocking reads and writes.
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+#define ROUNDTRIPS 100000
+
+static struct bench b;
+static long long t0;
+static int trips;
+
+// on_ping receives a pong, records the round trip and sends a ping.
+static int on_ping(struct loop *L, struct ev *ev) {
+  char c;
+  long long now;
+  if (read(ev->fd, &c, 1) != 1)
+    return -1;
+  now = bench_now();
+  bench_round(&b, now - t0, 1);
+  if (++trips >= ROUNDTRIPS)
+    return loop_del(L, ev);
+  t0 = now;
+  return write(ev->fd, &c, 1) == 1 ? 0 : -1;
+}
+
+// on_pong echoes a ping.
+static int on_pong(struct loop *L, struct ev *ev) {
+  char c;
+  if (read(ev->fd, &c, 1) != 1)
+    return -1;
+  if (trips + 1 >= ROUNDTRIPS)
+    loop_del(L, ev);
+  return write(ev->fd, &c, 1) == 1 ? 0 : -1;
+}
+
+static void *echo(void *arg) {
+  int fd = *(int *)arg;
+  char c;
+  while (read(fd, &c, 1) == 1)
+    if (write(fd, &c, 1) != 1)
+      break;
+  return NULL;
+}
+
+static void bench_pingpong(int threaded) {
+  struct loop *L;
+  struct ev ping = {0}, pong = {0};
+  pthread_t tid;
+  int sv[2];
+
+  if (!(L = loop_alloc(4)) || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("bench_pingpong");
+    exit(1);
+  }
+  ping.fd = sv[0];
+  ping.events = EV_READ;
+  ping.callback = on_ping;
+  loop_add(L, &ping);
+  if (threaded) {
+    pthread_create(&tid, NULL, echo, &sv[1]);
+  } else {
+    pong.fd = sv[1];
+    pong.events = EV_READ;
+    pong.callback = on_pong;
+    loop_add(L, &pong);
+  }
+
+  bench_init(&b, "pingpong", threaded ? "thread" : "loop", 1);
+  trips = 0;
+  t0 = bench_now();
+  write(sv[0], "x", 1);
+  loop_wait(L);
+  bench_report(&b);
+
+  close(sv[0]);
+  if (threaded)
+    pthread_join(tid, NULL);
+  close(sv[1]);
+  loop_free(L);
+}
+
+int main(void) {
+  bench_pingpong(0);
+  bench_pingpong(1);
+  return 0;
+}
@@ -0,0 +1,239 @@
+// Timer churn: adding, cancelling, resetting and expiring 1k to 1M timer
+// events on the minheap, the timing wheel and a timeout queue, and starting
+// and stopping standalone timers.
+
+#include <unistd.h>
+
+#include "bench.h"
+#include "x/ev.h"
+
+#define ROUND 1024  // operations per round.
+
+static int fired;
+
+static int on_timer(struct loop *L, struct ev *ev) {
+  fired++;
+  return 0;
+}
+
+static unsigned rnd(unsigned *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+// bench_churn adds n timer events due in 1 to 1000 seconds and then
+// cancels them in a random order, over and over.
+static void bench_churn(int flags, const char *impl, int n) {
+  struct bench add, del;
+  struct loop *L;
+  struct ev *evs;
+  int *order, i, j, k, t, repeat;
+  unsigned seed = 1;
+  long long t0;
+
+  L = loop_alloc_flags(n, flags);
+  evs = calloc(n, sizeof(*evs));
+  order = malloc(sizeof(int) * n);
+  if (!L || !evs || !order) {
+    perror("bench_churn");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    evs[i].fd = -1;
+    evs[i].events = EV_TIMER;
+    evs[i].ms = 1000 + rnd(&seed) % 1000000;
+    evs[i].callback = on_timer;
+    order[i] = i;
+  }
+
+  bench_init(&add, "timer_add", impl, n);
+  bench_init(&del, "timer_cancel", impl, n);
+  repeat = n >= 1000000 ? 2 : 1000000 / n;
+  for (k = 0; k < repeat; k++) {
+    for (i = n - 1; i > 0; i--) {  // shuffle
+      j = rnd(&seed) % (i + 1);
+      t = order[i], order[i] = order[j], order[j] = t;
+    }
+    for (i = 0; i < n; i += ROUND) {
+      t0 = bench_now();
+      for (j = i; j < n && j < i + ROUND; j++)
+        loop_add(L, &evs[j]);
+      bench_round(&add, bench_now() - t0, j - i);
+    }
+    for (i = 0; i < n; i += ROUND) {
+      t0 = bench_now();
+      for (j = i; j < n && j < i + ROUND; j++)
+        loop_del(L, &evs[order[j]]);
+      bench_round(&del, bench_now() - t0, j - i);
+    }
+  }
+  bench_report(&add);
+  bench_report(&del);
+
+  loop_free(L);
+  free(evs);
+  free(order);
+}
+
+static int on_fn(struct loop *L, void *arg) { return on_timer(L, NULL); }
+
+// bench_handles starts n standalone timers due in 1 to 1000 seconds and
+// then stops them in a random order, over and over.
+static void bench_handles(int flags, const char *impl, int n) {
+  struct bench start, stop;
+  struct loop *L;
+  long long *ids, t0;
+  int i, j, k, repeat;
+  unsigned seed = 1;
+
+  L = loop_alloc_flags(1, flags);
+  ids = malloc(sizeof(*ids) * n);
+  if (!L || !ids) {
+    perror("bench_handles");
+    exit(1);
+  }
+
+  bench_init(&start, "timer_start", impl, n);
+  bench_init(&stop, "timer_stop", impl, n);
+  repeat = n >= 1000000 ? 2 : 1000000 / n;
+  for (k = 0; k < repeat; k++) {
+    for (i = 0; i < n; i += ROUND) {
+      t0 = bench_now();
+      for (j = i; j < n && j < i + ROUND; j++)
+        ids[j] = timer_start(L, 1000 + rnd(&seed) % 1000000, 0, on_fn, NULL);
+      bench_round(&start, bench_now() - t0, j - i);
+    }
+    for (i = n - 1; i > 0; i--) {  // shuffle
+      j = rnd(&seed) % (i + 1);
+      t0 = ids[i], ids[i] = ids[j], ids[j] = t0;
+    }
+    for (i = 0; i < n; i += ROUND) {
+      t0 = bench_now();
+      for (j = i; j < n && j < i + ROUND; j++)
+        timer_stop(L, ids[j]);
+      bench_round(&stop, bench_now() - t0, j - i);
+    }
+  }
+  bench_report(&start);
+  bench_report(&stop);
+
+  loop_free(L);
+  free(ids);
+}
+
+// bench_reset adds n idle timeouts of 30 seconds and resets them in a
+// random order like connections seeing traffic, by deleting and adding
+// them again, or by moving them to the tail of a timeout queue.
+static void bench_reset(int flags, const char *impl, int n, int queue) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  struct tq *tq = NULL;
+  struct ev *ev;
+  int i, j, k, repeat;
+  unsigned seed = 1;
+  long long t0;
+
+  L = loop_alloc_flags(n, flags);
+  evs = calloc(n, sizeof(*evs));
+  if (!L || !evs || (queue && !(tq = tq_alloc(L, 30000)))) {
+    perror("bench_reset");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    evs[i].fd = -1;
+    evs[i].events = queue ? 0 : EV_TIMER;
+    evs[i].ms = 30000;
+    evs[i].callback = on_timer;
+    if (queue)
+      tq_add(tq, &evs[i]);
+    else
+      loop_add(L, &evs[i]);
+  }
+
+  bench_init(&b, "timer_reset", impl, n);
+  repeat = n >= 1000000 ? 2 : 1000000 / n;
+  for (k = 0; k < repeat; k++) {
+    for (i = 0; i < n; i += ROUND) {
+      t0 = bench_now();
+      for (j = i; j < n && j < i + ROUND; j++) {
+        ev = &evs[rnd(&seed) % n];
+        if (queue) {
+          tq_add(tq, ev);
+        } else {
+          loop_del(L, ev);
+          loop_add(L, ev);
+        }
+      }
+      bench_round(&b, bench_now() - t0, j - i);
+    }
+  }
+  bench_report(&b);
+
+  if (tq)
+    tq_free(tq);
+  loop_free(L);
+  free(evs);
+}
+
+// bench_expire adds n timer events due at once and dispatches them, which
+// is a storm of timeouts like idle connections accepted together.
+static void bench_expire(int flags, const char *impl, int n) {
+  struct bench b;
+  struct loop *L;
+  struct ev *evs;
+  int i, k, repeat, last;
+  long long t0;
+
+  L = loop_alloc_flags(n, flags);
+  evs = calloc(n, sizeof(*evs));
+  if (!L || !evs) {
+    perror("bench_expire");
+    exit(1);
+  }
+
+  bench_init(&b, "timer_expire", impl, n);
+  repeat = n >= 100000 ? 2 : 100000 / n;
+  for (k = 0; k < repeat; k++) {
+    for (i = 0; i < n; i++) {
+      evs[i].fd = -1;
+      evs[i].events = EV_TIMER;
+      evs[i].ms = 1;
+      evs[i].callback = on_timer;
+      loop_add(L, &evs[i]);
+    }
+    usleep(2000);
+    fired = 0;
+    while (fired < n) {
+      last = fired;
+      t0 = bench_now();
+      loop_dispatch(L, EV_TIMER);
+      bench_round(&b, bench_now() - t0, fired - last);
+    }
+  }
+  bench_report(&b);
+
+  loop_free(L);
+  free(evs);
+}
+
+int main(void) {
+  int n, scale = bench_scale();
+
+  for (n = 1000; n <= 1000000 && n / scale > 0; n *= 10) {
+    bench_churn(0, "heap", n / scale);
+    bench_churn(LOOP_WHEEL, "wheel", n / scale);
+    bench_handles(0, "heap", n / scale);
+    bench_handles(LOOP_WHEEL, "wheel", n / scale);
+  }
+  for (n = 1000; n <= 1000000 && n / scale > 0; n *= 10) {
+    bench_reset(0, "heap", n / scale, 0);
+    bench_reset(LOOP_WHEEL, "wheel", n / scale, 0);
+    bench_reset(0, "queue", n / scale, 1);
+  }
+  for (n = 1000; n <= 1000000 && n / scale > 0; n *= 10) {
+    bench_expire(0, "heap", n / scale);
+    bench_expire(LOOP_WHEEL, "wheel", n / scale);
+  }
+  return 0;
+}
@@ -13,10 +13,12 @@
 
 #define FREELIST_MAX 32
 #define BUF_MAX      1024
+#define IDLE_MS      (30 * 1000)
 
 struct server {
   struct loop *L;
   struct ev ev;
+  struct tq *idle;  // closes connections idle for IDLE_MS.
   struct list_head conns;
   struct list_head freelist;
   int len;
@@ -79,8 +81,11 @@ int on_recv_server(struct loop *L, struct ev *ev) {
     goto _close;
   if ((n = read(ev->fd, C->buf, BUF_MAX)) <= 0)
     goto _close;
+  tq_add(C->S->idle, ev);  // O(1) reset of the idle timeout.
   return broadcast(C->S, C->buf, n);
 _close:
+  tq_del(C->S->idle, ev);
+  loop_del(L, ev);
   close(ev->fd);
   list_del(&C->node);
   putconn(C->S, C);
@@ -103,7 +108,7 @@ int on_accept(struct loop *L, struct ev *ev) {
   C->S = S;
   list_add(&C->node, &S->conns);
   loop_add(L, &C->ev);
-  return 0;
+  return tq_add(S->idle, &C->ev);
 }
 
 void server_init(struct server *S, const char *host, unsigned short port) {
@@ -113,6 +118,8 @@ void server_init(struct server *S, const char *host, unsigned short port) {
   assert(S->ev.fd);
   S->ev.events = EV_READ;
   S->ev.callback = on_accept;
+  S->idle = tq_alloc(S->L, IDLE_MS);
+  assert(S->idle);
   S->len = 0;
   list_head_init(&S->freelist);
   list_head_init(&S->conns);
@@ -121,6 +128,7 @@ void server_init(struct server *S, const char *host, unsigned short port) {
 
 void server_close(struct server *S) {
   close(S->ev.fd);  // close listenfd
+  tq_free(S->idle);
   loop_free(S->L);
 }
 
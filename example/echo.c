@@ -8,7 +8,7 @@
 
 int echo(struct loop *L, struct ev *ev) {
   if (ev->revents & EV_TIMER) {
-    printf("timeout %d.%d\n", ev->when.tv_sec, ev->when.tv_usec);
+    printf("timeout %lld\n", ev->when);
     return loop_del(L, ev);
   }
   char buf[RBUF_MAX];
@@ -15,6 +15,7 @@
 
 int server_mode = 0;
 int udp_mode = 0;
+int nthreads = 1;
 
 struct server {
   struct loop *L;
@@ -22,6 +23,7 @@ struct server {
   struct list_head conns;
   struct list_head freelist;
   int len;
+  char buf[BUF_MAX];  // udp read buffer
 };
 
 struct tcp_conn {
@@ -76,23 +78,23 @@ int on_recv_server(struct loop *L, struct ev *ev) {
   }
   return 0;
 _close:
+  loop_del(L, ev);
   close(ev->fd);
   list_del(&C->node);
   putconn(C->S, C);
   return 0;
 }
 
-char udp_buf[BUF_MAX];
-
 static int udp_echo(struct loop *L, struct ev *ev) {
+  struct server *S = container_of(ev, struct server, ev);
   struct sockaddr sa;
   socklen_t sa_size;
   int n;
-  if ((n = recvfrom(ev->fd, udp_buf, BUF_MAX, 0, &sa, &sa_size)) < 0) {
+  if ((n = recvfrom(ev->fd, S->buf, BUF_MAX, 0, &sa, &sa_size)) < 0) {
     perror("recvfrom(net)");
     return n;
   }
-  if ((n = sendto(ev->fd, udp_buf, n, 0, &sa, sa_size)) < 0) {
+  if ((n = sendto(ev->fd, S->buf, n, 0, &sa, sa_size)) < 0) {
     perror("sendto(net)");
     return n;
   }
@@ -121,10 +123,11 @@ int on_accept(struct loop *L, struct ev *ev) {
   return 0;
 }
 
-void server_init(struct server *S, const char *host, unsigned short port) {
-  S->L = loop_alloc(32);
-  assert(S->L);
-  S->ev.fd = udp_mode ? udp_bind(host, port) : tcp_listen(host, port);
+void server_init(struct server *S, struct loop *L, const char *host,
+                 unsigned short port, int flags) {
+  S->L = L;
+  S->ev.fd = udp_mode ? udp_bind_flags(host, port, flags)
+                      : tcp_listen_flags(host, port, flags);
   assert(S->ev.fd);
   S->ev.events = EV_READ;
   S->ev.callback = on_accept;
@@ -136,17 +139,53 @@ void server_init(struct server *S, const char *host, unsigned short port) {
 
 void server_close(struct server *S) {
   close(S->ev.fd);  // close listenfd
-  loop_free(S->L);
 }
 
 int server_run(struct server *S) { return loop_wait(S->L); }
 
+struct server_group {
+  const char *host;
+  unsigned short port;
+  struct server *servers;  // one server per thread
+};
+
+static int server_group_init(struct loop *L, int i, void *ud) {
+  struct server_group *G = ud;
+  server_init(&G->servers[i], L, G->host, G->port, NET_REUSEPORT);
+  return 0;
+}
+
+// run_server_group runs a server on each of nthreads threads, which listen
+// on the same port so that the kernel spreads clients across them.
+int run_server_group(const char *host, unsigned short port) {
+  struct server_group G = {host, port, NULL};
+  struct group *g;
+  int i, err;
+  G.servers = xalloc(NULL, sizeof(struct server) * nthreads);
+  assert(G.servers);
+  g = group_alloc(nthreads, 32, 0);
+  assert(g);
+  if ((err = group_start(g, server_group_init, &G)) == 0)
+    err = group_join(g);
+  for (i = 0; i < nthreads; i++)
+    server_close(&G.servers[i]);
+  group_free(g);
+  xfree(G.servers);
+  return err;
+}
+
 int run_server(const char *host, unsigned short port) {
   struct server S;
+  struct loop *L;
   int err;
-  server_init(&S, host, port);
+  if (nthreads > 1)
+    return run_server_group(host, port);
+  L = loop_alloc(32);
+  assert(L);
+  server_init(&S, L, host, port, 0);
   err = server_run(&S);
   server_close(&S);
+  loop_free(L);
   return err;
 }
 
@@ -235,6 +274,7 @@ void usage(const char *argv0) {
           "options:\n"
           "  -h    display this help and exit\n"
           "  -l    listen mode, for inbound connects\n"
+          "  -n N  listen on N threads sharing the port\n"
           "  -t    TCP mode (default)\n"
           "  -u    UDP mode\n",
           argv0);
@@ -245,8 +285,11 @@ int main(int argc, char **argv) {
   unsigned short port;
   int opt, err;
 
-  while ((opt = getopt(argc, argv, "ltuh")) > 0) {
+  while ((opt = getopt(argc, argv, "ltun:h")) > 0) {
     switch (opt) {
+    case 'n':
+      nthreads = atoi(optarg);
+      break;
     case 't':
       break;
     case 'u':
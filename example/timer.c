@@ -5,8 +5,8 @@
 
 int f(struct loop *L, struct ev *ev) {
   assert(ev->revents == EV_TIMER);
-  printf("timeout %d.%d\n", ev->when.tv_sec, ev->when.tv_usec);
-  loop_add(L, ev);
+  printf("timeout %lld\n", ev->when);
+  return 0;
 }
 
 int main(void) {
@@ -16,7 +16,7 @@ int main(void) {
   assert(L);
 
   struct ev ev;
-  ev.events = EV_TIMER;
+  ev.events = EV_TIMER | EV_PERSIST;
   ev.ms = 1000;
   ev.callback = f;
   loop_add(L, &ev);
@@ -0,0 +1,69 @@
+// Bounces a message between two bios over a socketpair and dumps the
+// trace ring of the event loop, e.g.
+//
+//   make DEFS=-DX_TRACE && make DEFS=-DX_TRACE example
+//   ./example/trace.c.out > trace.json   # open in chrome://tracing
+//   ./example/trace.c.out perf           # lines like `perf script`
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "x/ev.h"
+#include "x/io.h"
+
+#define ROUNDS 100
+
+struct loop *L;
+struct bio *ping, *pong;
+int rounds;
+
+ssize_t on_ping(struct bio *B, const char *p, size_t n) {
+  if (++rounds >= ROUNDS) {
+    loop_break(L);
+    return n;
+  }
+  bio_write(B, "ping", 4);
+  bio_flush(B);
+  return n;
+}
+
+ssize_t on_pong(struct bio *B, const char *p, size_t n) {
+  bio_write(B, "pong", 4);
+  bio_flush(B);
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  int sv[2], format = TRACE_CHROME, err = 0;
+
+  if (argc > 1 && !strcmp(argv[1], "perf"))
+    format = TRACE_PERF;
+
+  L = loop_alloc(2);
+  assert(L);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    return 1;
+  }
+
+  // the buffers hold every round, since the callbacks eat what they read.
+  ping = bio_alloc(L, sv[0], 4096, 64, on_ping, NULL);
+  pong = bio_alloc(L, sv[1], 4096, 64, on_pong, NULL);
+  assert(ping && pong);
+
+  bio_write(ping, "ping", 4);
+  bio_flush(ping);
+  loop_wait(L);
+
+  if ((err = loop_trace_dump(L, STDOUT_FILENO, format)) < 0)
+    fprintf(stderr, "no trace, build libx with make DEFS=-DX_TRACE\n");
+
+  loop_free(L);
+  bio_free(ping);
+  bio_free(pong);
+  close(sv[0]);
+  close(sv[1]);
+  return err < 0;
+}
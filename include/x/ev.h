@@ -18,15 +18,63 @@ extern "C" {
 #define EV_IO    (EV_READ | EV_WRITE)
 #define EV_ALL   (EV_READ | EV_WRITE | EV_TIMER)
 
+// modes of IO events, ORed with events.
+#define EV_ET        (1 << 3)  // edge-triggered, fired only on changes.
+#define EV_ONCE      (1 << 4)  // fired once, re-armed by loop_mod.
+#define EV_EXCLUSIVE (1 << 5)  // fired on one of the loops sharing fd.
+
+// priority classes of IO events, ORed with events. Fired IO events
+// of EV_PRIO_HIGH, e.g. of control sockets, are dispatched first in
+// an iteration, then the others, then timer events, and those of
+// EV_PRIO_LOW, e.g. of bulk transfers, last.
+#define EV_PRIO_HIGH (1 << 8)
+#define EV_PRIO_LOW  (1 << 9)
+
+// modes of timer events, ORed with events.
+#define EV_PERSIST (1 << 6)  // fired every ms until deleted.
+#define EV_CATCHUP (1 << 7)  // fire missed ticks of EV_PERSIST too.
+
+// flags for loop_alloc_flags.
+#define LOOP_WHEEL (1 << 0)  // use a timing wheel instead of a minheap.
+#define LOOP_HIRES (1 << 1)  // fire timer events in sub-milliseconds.
+#define LOOP_STATS (1 << 2)  // collect statistics, see loop_stats.
+
+// backends for loop_alloc_flags, ORed with flags, see loop_backend.
+#define LOOP_EPOLL   (1 << 8)
+#define LOOP_KQUEUE  (2 << 8)
+#define LOOP_URING   (3 << 8)
+#define LOOP_POLL    (4 << 8)
+#define LOOP_SELECT  (5 << 8)
+#define LOOP_BACKEND (7 << 8)  // mask of the backend.
+
+// options for loop_setopt.
+#define LOOP_OPT_TIMER_BUDGET 1  // max timer events per dispatch (1024).
+#define LOOP_OPT_BUSY_POLL    2  // microseconds to spin before blocking (0).
+#define LOOP_OPT_SLACK        3  // microseconds timer events may be late (0).
+#define LOOP_OPT_LOW_BUDGET   4  // max EV_PRIO_LOW events per dispatch.
+#define LOOP_OPT_IO_BUDGET    5  // max IO events per dispatch.
+#define LOOP_OPT_TIME_BUDGET  6  // max microseconds in IO callbacks (0).
+#define LOOP_OPT_BATCH        7  // IO events per wakeup to wait for (0).
+#define LOOP_OPT_BATCH_DELAY  8  // max microseconds to wait for them (100).
+
 // struct loop represents an event loop.
 struct loop;
 
-// struct ev represents an IO event or a timer event.
+// struct ev represents an IO event or a timer event. It is 48 bytes on
+// 64-bit systems, what the event loop keeps per fd, e.g. the events
+// registered with the kernel, lives in its fd table rather than here.
 struct ev {
   // file descriptor for an IO event.
   int fd;
   // events to be watched, can be EV_READ, EV_WRITE for
   // an IO event, or EV_TIMER for an timer event, or both.
+  // A timer event fires once unless EV_PERSIST is given, which
+  // makes it fire every ms from the previous deadline, skipping
+  // missed ticks unless EV_CATCHUP is given too.
+  // An IO event is level-triggered unless EV_ET or EV_ONCE
+  // is given, which are honored by epoll, kqueue and io_uring,
+  // and so is EV_EXCLUSIVE by epoll only, which can't go with
+  // EV_ONCE, loop_ctl fails with EINVAL.
   int events;
   // milliseconds to wait for a timer event.
   long long ms;
@@ -35,9 +83,11 @@ struct ev {
   // user data
   void *ud;
 
-  // absolute time to fire an timer event, initialized by
-  // the event loop.
-  struct timeval when;
+  // absolute time to fire an timer event in nanoseconds on
+  // the monotonic clock of loop_now, initialized by the event
+  // loop unless ms is zero. It used to be a struct timeval of
+  // the wall clock, code reading or setting it must be changed.
+  long long when;
   // index into the minheap for an timer event, initialized
   // by the event loop.
   int id;
@@ -45,18 +95,195 @@ struct ev {
   int revents;
 };
 
+// operations of struct ev_req.
+#define EV_OP_READ    1
+#define EV_OP_WRITE   2
+#define EV_OP_ACCEPT  3
+#define EV_OP_CONNECT 4
+
+// struct ev_req represents a request to read, write, accept or
+// connect, which is completed by the kernel rather than polled
+// for readiness, see loop_submit.
+struct ev_req {
+  // operation, can be EV_OP_READ, EV_OP_WRITE, EV_OP_ACCEPT
+  // or EV_OP_CONNECT.
+  int op;
+  // file descriptor to operate on.
+  int fd;
+  // buffer to read into or write from, or address to accept
+  // into or connect to.
+  void *buf;
+  // size of buf, or of the address which is updated on accept.
+  unsigned len;
+  // result like the return value of the syscall, or -errno,
+  // initialized by the event loop.
+  long long res;
+  // callback function for a completed request.
+  int (*callback)(struct loop *, struct ev_req *);
+  // user data
+  void *ud;
+
+  // next completed request, used by the event loop.
+  struct ev_req *next;
+};
+
+// the number of buckets of a histogram of struct loop_stats.
+#define LOOP_STATS_BUCKETS 32
+
+// struct loop_stats is a snapshot of the statistics of an event loop
+// created with LOOP_STATS. Histograms are log2-bucketed, bucket 0
+// counts zeros, bucket i counts values in [2^(i-1), 2^i), and the
+// last one counts the rest.
+struct loop_stats {
+  // calls to loop_dispatch.
+  unsigned long long iterations;
+  // successful calls to loop_ctl by operation.
+  unsigned long long ctl_add;
+  unsigned long long ctl_mod;
+  unsigned long long ctl_del;
+  // calls to the backend made for them, which are fewer when
+  // changes are folded before being applied.
+  unsigned long long ctl_calls;
+  // polls without blocking while busy polling, iterations which got
+  // events by them, and those which blocked after all, see
+  // LOOP_OPT_BUSY_POLL.
+  unsigned long long busy_polls;
+  unsigned long long busy_hits;
+  unsigned long long busy_blocks;
+  // IO events left to the next iteration by the budgets, summed
+  // over iterations, see LOOP_OPT_IO_BUDGET.
+  unsigned long long deferred;
+  // IO events whose callback called loop_yield.
+  unsigned long long yields;
+  // polls delayed to collect a batch, and those which got one, see
+  // LOOP_OPT_BATCH.
+  unsigned long long batch_delays;
+  unsigned long long batch_hits;
+  // nanoseconds spent polling for IO events per iteration.
+  unsigned long long poll_ns[LOOP_STATS_BUCKETS];
+  // IO events fired per iteration.
+  unsigned long long events[LOOP_STATS_BUCKETS];
+  // nanoseconds a poll was delayed by to collect a batch.
+  unsigned long long delay_ns[LOOP_STATS_BUCKETS];
+  // nanoseconds spent in a callback function.
+  unsigned long long callback_ns[LOOP_STATS_BUCKETS];
+  // nanoseconds a timer event fired after ev::when.
+  unsigned long long lateness_ns[LOOP_STATS_BUCKETS];
+};
+
+// types of struct trace_rec.
+#define TRACE_POLL_ENTER 1  // arg: the timeout in microseconds, or -1.
+#define TRACE_POLL_EXIT  2  // arg: IO events fired.
+#define TRACE_CALLBACK   3  // arg: ev::revents or ev_req::res, val: ns.
+#define TRACE_CTL        4  // arg: EV_CTL_*, val: ev::events.
+#define TRACE_BIO_READ   5  // arg: bytes read, or a negative error.
+#define TRACE_BIO_WRITE  6  // arg: bytes buffered by bio_write.
+#define TRACE_BIO_FLUSH  7  // arg: bytes written, or a negative error.
+
+// formats for loop_trace_dump.
+#define TRACE_CHROME 1  // JSON of the Trace Event Format.
+#define TRACE_PERF   2  // text like `perf script` prints.
+
+// struct trace_rec is a record of the trace ring of an event loop, which
+// is kept only if libx is built with X_TRACE, e.g. make DEFS=-DX_TRACE.
+struct trace_rec {
+  long long ts;  // monotonic time in nanoseconds it began at.
+  int type;      // TRACE_*.
+  int fd;        // the fd of the event, or -1.
+  int arg;
+  int val;
+};
+
 /* Event Loop Primitives */
 
 // loop_alloc creates an event loop.
 struct loop *loop_alloc(int);
+// loop_alloc_flags creates an event loop with flags, LOOP_WHEEL
+// makes timer events kept in a hierarchical timing wheel with
+// O(1) insertion, removal and expiration in milliseconds, which
+// suits a large number of timers like idle timeouts better than
+// the minheap used by default. LOOP_HIRES makes the event loop
+// wait for timer events in nanoseconds instead of rounding them
+// up to milliseconds. LOOP_STATS makes the event loop collect
+// statistics for loop_stats. One of LOOP_EPOLL, LOOP_URING, etc.
+// makes the event loop use that backend or fail, without one it
+// uses the backend named by $LIBX_BACKEND, e.g. "poll", or else
+// the first one working of those built in.
+struct loop *loop_alloc_flags(int, int);
+// loop_backend returns the name of the backend of the event loop,
+// "epoll", "kqueue", "uring", "poll" or "select".
+const char *loop_backend(struct loop *);
 // loop_dispatch polls fired events, calls their callback
 // functions, and returns the number of fired events on success
 // or the value returned by the first callback function returning
 // a negative integer.
 int loop_dispatch(struct loop *, int);
+// loop_setopt sets an option of the event loop, returns 0 on
+// success or a negative number on an error. LOOP_OPT_BUSY_POLL
+// makes the event loop poll IO events without blocking for the
+// given microseconds before it blocks, which trades CPU for the
+// latency of sleeping and being woken up by the kernel.
+// LOOP_OPT_SLACK lets timer events fire up to the given microseconds
+// late, so that those due within the same slack fire together.
+// LOOP_OPT_LOW_BUDGET defers IO events of EV_PRIO_LOW beyond the
+// given number per iteration to the next, which doesn't block.
+// LOOP_OPT_IO_BUDGET and LOOP_OPT_TIME_BUDGET do so for all the IO
+// events, except those of EV_PRIO_HIGH, beyond the given number or
+// microseconds per iteration. LOOP_OPT_BATCH makes the event loop
+// delay a poll by up to LOOP_OPT_BATCH_DELAY microseconds after an
+// iteration which got fewer IO events than the given number, so that
+// more of them are collected per wakeup, like interrupt coalescing,
+// which trades latency for CPU per event.
+int loop_setopt(struct loop *, int, long long);
 // loop_wait calls loop_dispatch in an infinite loop on all
 // events, and returns the toal amount of dispatched events.
 int loop_wait(struct loop *);
+// loop_now returns the monotonic time in nanoseconds cached by
+// the event loop once per call to loop_dispatch, which is what
+// timer events added by callbacks are based on.
+long long loop_now(struct loop *);
+// loop_stats copies the statistics of an event loop created with
+// LOOP_STATS, returns 0 on success or -1 if it has none. Must be
+// called in the thread of the event loop, e.g. by loop_post.
+int loop_stats(struct loop *, struct loop_stats *);
+// loop_trace copies the last records of the trace ring of an event
+// loop, at most the given number, oldest first, and returns how many
+// are copied, or -1 unless libx is built with X_TRACE. It is safe to
+// call from any thread and lock-free, records overwritten while they
+// are copied are left out.
+int loop_trace(struct loop *, struct trace_rec *, int);
+// loop_trace_dump writes the trace ring of an event loop to an fd in
+// TRACE_CHROME, which chrome://tracing and Perfetto open, or in
+// TRACE_PERF. Returns 0 on success or a negative number on an error,
+// it is safe to call from any thread like loop_trace.
+int loop_trace_dump(struct loop *, int, int);
+// loop_trace_add adds a record of the given type, fd and arg to the
+// trace ring of an event loop built with X_TRACE, in the thread of
+// the event loop, e.g. by bio, or does nothing.
+void loop_trace_add(struct loop *, int, int, int);
+// loop_yield makes the IO event whose callback is running dispatched
+// again once the other fds got their turn, without waiting for the
+// kernel to report it, so that the callback can do a bounded amount of
+// work, e.g. one read, and leave the rest for later. Events yielded by
+// the callbacks called first in an iteration are dispatched again in
+// the same iteration, those yielded after are left to the next, which
+// polls without blocking so that other fds are not starved. Returns 0
+// on success or a negative number if the event is not registered.
+int loop_yield(struct loop *, struct ev *);
+// loop_break makes loop_wait return after the current call to
+// loop_dispatch, it is safe to call from any thread.
+void loop_break(struct loop *);
+// loop_post makes the event loop call fn(loop, arg) in its own
+// thread, it is safe to call from any thread and lock-free, and
+// returns 0 on success or a negative number on an error. Posted
+// functions are called in order, and those not called yet are
+// dropped by loop_free.
+int loop_post(struct loop *, void (*)(struct loop *, void *), void *);
+// loop_submit queues a request which is submitted along with
+// others by the next call to loop_dispatch, and whose callback
+// is called once it completes. Returns 0 on success, or -1 with
+// errno set to ENOSYS unless the backend is io_uring.
+int loop_submit(struct loop *, struct ev_req *);
 // loop_ctl adds, modifies or deletes an event in the event
 // loop, returns 0 on success or a negative number on an error
 int loop_ctl(struct loop *, int, struct ev *);
@@ -64,6 +291,82 @@ int loop_ctl(struct loop *, int, struct ev *);
 // removes all event being watched from the kernel.
 void loop_free(struct loop *);
 
+/* Timeout Queues */
+
+// struct tq represents a timeout queue of an event loop, where every
+// event times out after the same milliseconds, e.g. an idle timeout
+// of connections. Events are kept in FIFO order of their deadlines,
+// so adding, resetting and deleting an event all cost O(1), and only
+// the head of the queue sits in the timer engine of the event loop.
+struct tq;
+
+// tq_alloc creates a timeout queue on an event loop with the given
+// milliseconds.
+struct tq *tq_alloc(struct loop *, long long);
+// tq_add adds an event to a timeout queue, or moves it to the tail
+// if it is in the queue already, so that it times out after the
+// milliseconds of the queue from now on. The callback of the event
+// is called with EV_TIMER in ev::revents once it times out, and the
+// event is removed from the queue by then. Its ev::when is set by
+// the queue, and its ev::id is used by the queue, so it must not be
+// an EV_TIMER event of the event loop at the same time. Returns 0
+// on success or a negative number on an error.
+int tq_add(struct tq *, struct ev *);
+// tq_del removes an event from a timeout queue if it is in it.
+void tq_del(struct tq *, struct ev *);
+// tq_free frees a timeout queue, events left in it never time out.
+// It may be called by a callback of the queue itself, in which case
+// the queue is freed once the callback returns.
+void tq_free(struct tq *);
+
+/* Timers */
+
+// timer_start starts a standalone timer on an event loop, which calls
+// fn(loop, arg) after the given milliseconds, or every milliseconds if
+// EV_PERSIST is given in flags, optionally with EV_CATCHUP. The timer is
+// owned by the event loop, so there's no struct ev to keep around, and
+// the number of timers is only limited by memory. Returns a positive
+// handle on success or a negative number on an error. A timer which
+// doesn't repeat is gone once fn returns, unless fn calls timer_again.
+// A negative number returned by fn is returned by loop_dispatch.
+long long timer_start(struct loop *, long long, int,
+                      int (*)(struct loop *, void *), void *);
+// timer_stop stops a timer, returns 0 on success or a negative number
+// if the handle is stale, i.e. the timer has fired or been stopped.
+int timer_stop(struct loop *, long long);
+// timer_again restarts a timer to fire after its milliseconds from now,
+// e.g. to push back a deadline, returns 0 on success or a negative
+// number if the handle is stale.
+int timer_again(struct loop *, long long);
+
+/* Loop Group */
+
+// struct group represents N event loops running on N threads,
+// each of which is pinned to a CPU.
+struct group;
+
+// group_alloc creates a group of N event loops, each created
+// by loop_alloc_flags with the given backlog and flags.
+struct group *group_alloc(int, int, int);
+// group_loop returns the i-th event loop of a group.
+struct loop *group_loop(struct group *, int);
+// group_start spawns a thread for each event loop, which calls
+// the init function with the loop, its index and the user data,
+// and then loop_wait if init returns 0, e.g. init may open a
+// listener with NET_REUSEPORT and add it to the loop so that the
+// kernel spreads connections across the threads. Returns 0 on
+// success or a negative number on an error.
+int group_start(struct group *, int (*)(struct loop *, int, void *), void *);
+// group_stop calls loop_break on every event loop of a group.
+void group_stop(struct group *);
+// group_join waits for all the threads to exit and returns the
+// total amount of dispatched events, or the first error returned
+// by loop_wait or init.
+int group_join(struct group *);
+// group_free frees a group and its event loops, after it has been
+// joined.
+void group_free(struct group *);
+
 /* Useful Macros */
 
 #define loop_add(L, e) loop_ctl(L, EV_CTL_ADD, e)
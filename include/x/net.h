@@ -10,9 +10,16 @@ extern "C" {
 #include <sys/un.h>
 
 /* UDP or TCP */
+
+// flags for udp_bind_flags and tcp_listen_flags.
+#define NET_REUSEPORT (1 << 0)  // let sockets share a port by SO_REUSEPORT.
+#define NET_BUSY_POLL (1 << 1)  // busy poll the socket, see set_busy_poll.
+
 int udp_bind(const char *host, unsigned short port);
+int udp_bind_flags(const char *host, unsigned short port, int flags);
 int udp_connect(int sockfd, const char *host, unsigned short port);
 int tcp_listen(const char *host, unsigned short port);
+int tcp_listen_flags(const char *host, unsigned short port, int flags);
 int tcp_accept(int sockfd, struct sockaddr *sa, socklen_t *sa_size);
 int tcp_connect(const char *host, unsigned short port);
 
@@ -27,6 +34,12 @@ int unix_accept(int sockfd, struct sockaddr_un *sa);
 
 void set_blocking(int, int);
 void set_cloexec(int);
+// set_busy_poll makes the kernel busy poll the device queue of a socket
+// for up to the given microseconds when it has no data (SO_BUSY_POLL),
+// and prefer that to interrupts (SO_PREFER_BUSY_POLL, Linux 5.11), which
+// pairs with LOOP_OPT_BUSY_POLL. Raising it above net.core.busy_read
+// needs CAP_NET_ADMIN. Returns 0 on success or -1 on an error.
+int set_busy_poll(int, int);
 
 /* Tun Device */
 
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 
 #include "x/ev.h"
@@ -10,6 +11,12 @@
 #define buf_head(p)  ((p)->ptr + (p)->head)
 #define buf_tail(p)  ((p)->ptr + (p)->tail)
 
+#ifdef X_TRACE
+#define bio_trace(io, type, n) loop_trace_add((io)->loop, type, (io)->ev.fd, n)
+#else
+#define bio_trace(io, type, n) ((void)0)
+#endif
+
 struct buf {
   int head;
   int tail;
@@ -19,6 +26,7 @@ struct buf {
 
 struct bio {
   struct ev ev;
+  struct loop *loop;
   struct buf recvq;
   struct buf sendq;
   __bio_read read;
@@ -44,6 +52,7 @@ static int on_read(struct loop *L, struct ev *ev) {
   }
 
   n = read(ev->fd, buf_tail(buf), l);
+  bio_trace(io, TRACE_BIO_READ, n < 0 ? -errno : n);
   if (n < 0)
     return n;
   else if (n == 0) {
@@ -53,6 +62,10 @@ static int on_read(struct loop *L, struct ev *ev) {
   }
   buf->tail += n;
   *buf_tail(buf) = 0;
+  // yield if the buffer is filled up, there may be more to read after
+  // the other connections get their turn.
+  if (n == l)
+    loop_yield(L, ev);
 cb:
   n = buf_len(buf);
   m = io->read(io, buf_head(buf), n);
@@ -91,6 +104,7 @@ ssize_t bio_write(struct bio *io, const char *p, size_t size) {
   memcpy(buf_tail(buf), p, n);
   buf->tail += n;
   *buf_tail(buf) = 0;
+  bio_trace(io, TRACE_BIO_WRITE, n);
   return n;
 }
 
@@ -99,9 +113,10 @@ ssize_t bio_flush(struct bio *io) {
   ssize_t w, n = 0, len = buf_len(buf);
   while (n < len) {
     w = write(io->ev.fd, buf_head(buf) + n, len - n);
-    if (w < 0)
+    if (w < 0) {
+      bio_trace(io, TRACE_BIO_FLUSH, -errno);
       return w;
-    else if (w == 0) {
+    } else if (w == 0) {
       if (io->close)
         io->close(io);
       return 0;
@@ -109,6 +124,7 @@ ssize_t bio_flush(struct bio *io) {
     n += w;
   }
   buf_reset(buf, buf->ptr, buf->cap);
+  bio_trace(io, TRACE_BIO_FLUSH, n);
   return n;
 }
 
@@ -120,6 +136,7 @@ struct bio *bio_alloc(struct loop *L, int fd, int nr, int nw,  //
   io->ev.fd = fd;
   io->ev.events = EV_READ;
   io->ev.callback = on_read;
+  io->loop = L;
   if (loop_add(L, &io->ev) < 0)
     goto err;
   assert(__recv);
@@ -1,39 +1,396 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "x/ev.h"
 #include "x/mm.h"
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// struct ev_fired is an fd fired by the backend, which points right to
+// its entry of the fd table so that dispatching it takes no lookup. An
+// entry stays put while loop_dispatch runs, see fdt_release, and the
+// sequence of its registration tells if the event it was fired for has
+// been deleted since, even if the fd is added again.
 struct ev_fired {
-  int fd;
-  int events;  // fired events (like event from poll.h)
+  struct fdent *e;
+  int events;    // fired events (like event from poll.h)
+  unsigned seq;  // fdent::seq when it is fired.
+};
+
+// struct hnode is a slot of the minheap, the deadline of a timer event is
+// kept along with it so that sifting the heap doesn't chase pointers.
+struct hnode {
+  long long when;  // ev::when in nanoseconds.
+  struct ev *ev;
+};
+
+// struct task is a function posted to the event loop by loop_post.
+struct task {
+  struct task *next;
+  void (*fn)(struct loop *, void *);
+  void *arg;
+};
+
+// The fd table is a two-level table, file descriptors are split into
+// pages of FDT_PAGE entries which are allocated only for the ones in use
+// and freed once no event is left in them. So a few high or scattered
+// fds cost a few pages rather than a flat array as large as the highest.
+#define FDT_BITS 10
+#define FDT_PAGE (1 << FDT_BITS)
+#define FDT_MASK (FDT_PAGE - 1)
+
+// events of an fd registered with the backend.
+#define FDE_EVENTS (EV_IO | EV_ET | EV_ONCE | EV_EXCLUSIVE)
+
+// flags of struct fdent.
+#define FDE_USED   (1 << 0)  // counted in fdpage::len.
+#define FDE_QUEUED (1 << 1)  // in loop::changes.
+#define FDE_REARM  (1 << 2)  // to be registered again even if unchanged.
+#define FDE_READD  (1 << 3)  // to be deleted and added, see changes_apply.
+#define FDE_YIELD  (1 << 4)  // its callback called loop_yield.
+
+// struct fdent is an entry of the fd table.
+struct fdent {
+  struct ev *ev;  // IO event watching the fd.
+  union {         // used by the backend.
+    struct {
+      unsigned gen;  // see ev_uring.c.
+      int events;    // see ev_uring.c.
+    };
+    int slot;  // see ev_poll.c.
+  };
+  unsigned short mask;    // events registered with the backend.
+  unsigned short want;    // events to register before the next poll.
+  unsigned char flags;    // FDE_*.
+  unsigned char revents;  // used by the backend, see ev_kqueue.c.
+  unsigned char pending;  // events fired but not dispatched, see loop::ready.
+  unsigned seq;           // bumped by EV_CTL_DEL, see struct ev_fired.
+};
+
+struct fdpage {
+  int len;  // the number of entries used.
+  struct fdent ents[FDT_PAGE];
 };
 
 struct loop {
+  int flags;               // flags given to loop_alloc_flags.
+  int dispatching;         // whether loop_dispatch is running.
+  long long now;           // cached monotonic time in nanoseconds.
+  int timer_budget;        // max timer events to dispatch per iteration.
+  long long busy_poll;     // nanoseconds to spin before blocking.
+  int batch;               // IO events per wakeup to wait for, or 0.
+  int last_events;         // IO events fired by the last poll.
+  long long batch_delay;   // max nanoseconds to delay a poll by.
+  long long slack;         // nanoseconds timer events may be late.
+  int stop;                // set by loop_break to stop loop_wait.
+  int wakefd[2];           // read and write ends to wake up the loop.
+  struct ev wake;          // IO event on loop::wakefd[0].
+  int woken;               // whether loop::wakefd has been signaled.
+  struct task *tasks;      // tasks posted by other threads, LIFO.
+  int len_req;             // the number of requests in flight.
+  struct ev_req *done;     // requests completed, see loop_submit.
+  struct ev_req **done_tail;
   int maxfd;               // maximum file discriptor of IO events.
-  int cap;                 // the number of slots allocated for loop::events;
+  int cap;                 // the number of slots allocated for loop::fired.
   int len;                 // the number of timer events.
   int len_io;              // the number of IO events.
   struct ev_fired *fired;  // events fired.
-  struct ev **events;      // events being watched, indexed by ev::fd.
-  struct ev **heap;        // minheap for timer events.
+  struct fdpage **pages;   // the fd table, indexed by ev::fd >> FDT_BITS.
+  int npages;              // the number of slots allocated for loop::pages.
+  struct fdpage *spare;    // a page freed lately, kept for reuse.
+  int *changes;            // fds whose registration is to be changed.
+  int nchanges;            // the number of fds in loop::changes.
+  int changes_cap;         // the number of slots allocated for loop::changes.
+  int reclaim;             // pages emptied by loop_dispatch to free after.
+  int *ready;              // fds with events pending, see fdent::pending.
+  int nready;              // the number of fds in loop::ready.
+  int ready_cap;           // the number of slots allocated for loop::ready.
+  int low_budget;          // max EV_PRIO_LOW events to dispatch per iteration.
+  int io_budget;           // max IO events to dispatch per iteration.
+  int io_left;             // IO events left to dispatch in this iteration.
+  long long time_budget;   // max nanoseconds to dispatch IO events for.
+  long long io_until;      // time to stop dispatching IO events at, or 0.
+  struct hnode *heap;      // 4-ary minheap for timer events.
+  int heap_cap;            // the number of slots allocated for loop::heap.
+  struct ev *firing;       // the timer event whose callback is running.
+  struct wheel *wheel;     // timing wheel for timer events, see LOOP_WHEEL.
+  struct timer **timers;   // pages of standalone timers, see timer_start.
+  int ntimers;             // the number of pages in loop::timers.
+  int timer_free;          // the first free slot of loop::timers, or -1.
+  // statistics, see LOOP_STATS.
+  struct loop_stats stats;
+#ifdef X_TRACE
+  // the trace ring, see trace_add.
+  struct trace_rec *trace;
+  unsigned long long trace_head;  // the number of records ever added.
+  int trace_id;                   // the number of the loop, from 1.
+#endif
+  // the backend talking to the kernel, see backend_init.
+  const struct backend *api;
   void *state;             // implementation-specific data.
 };
 
-#ifdef __linux__
+#define NS_PER_MS 1000000LL
+
+// fdt_get returns the entry of 'fd', or NULL if its page is not allocated
+// or 'fd' is negative.
+static inline struct fdent *fdt_get(struct loop *loop, int fd) {
+  unsigned i = (unsigned)fd >> FDT_BITS;
+  if (fd < 0 || i >= (unsigned)loop->npages || !loop->pages[i])
+    return NULL;
+  return &loop->pages[i]->ents[fd & FDT_MASK];
+}
+
+// fdt_alloc returns the entry of 'fd' and marks it used, allocating its
+// page if needed, or NULL on an error.
+static struct fdent *fdt_alloc(struct loop *loop, int fd) {
+  struct fdpage **pages, *page;
+  int i = fd >> FDT_BITS, n = loop->npages;
+
+  if (unlikely(fd < 0)) {
+    errno = EBADF;
+    return NULL;
+  }
+  if (i >= n) {
+    while (i >= n)
+      n = n + n / 2 + 1;  // 1.5x the current capacity
+    pages = xalloc(loop->pages, sizeof(*pages) * n);
+    if (unlikely(!pages))
+      return NULL;
+    memset(pages + loop->npages, 0, sizeof(*pages) * (n - loop->npages));
+    loop->pages = pages;
+    loop->npages = n;
+  }
+  if (!(page = loop->pages[i])) {
+    if ((page = loop->spare) != NULL)
+      loop->spare = NULL;
+    else if (unlikely(!(page = xalloc(NULL, sizeof(*page)))))
+      return NULL;
+    memset(page, 0, sizeof(*page));
+    loop->pages[i] = page;
+  }
+  if (!(page->ents[fd & FDT_MASK].flags & FDE_USED)) {
+    page->ents[fd & FDT_MASK].flags |= FDE_USED;
+    page->len++;
+  }
+  return &page->ents[fd & FDT_MASK];
+}
+
+// fdt_release marks the entry of 'fd' unused if it has neither an event
+// nor a registration, and frees its page once no entry is used.
+static void fdt_release(struct loop *loop, int fd) {
+  struct fdpage *page = loop->pages[fd >> FDT_BITS];
+  struct fdent *e = &page->ents[fd & FDT_MASK];
+
+  if (e->ev || e->mask || e->pending || (e->flags & FDE_QUEUED) ||
+      !(e->flags & FDE_USED))
+    return;
+  e->flags &= ~FDE_USED;
+  if (--page->len)
+    return;
+  // loop::fired may point into the page, so it is freed after the
+  // dispatch by fdt_reclaim.
+  if (loop->dispatching) {
+    loop->reclaim = 1;
+    return;
+  }
+  loop->pages[fd >> FDT_BITS] = NULL;
+  // keep one page around so that an fd opened and closed over and over
+  // doesn't allocate and free a page every time.
+  if (loop->spare)
+    xfree(loop->spare);
+  loop->spare = page;
+}
+
+// fdt_reclaim frees the pages emptied while loop_dispatch runs.
+static void fdt_reclaim(struct loop *loop) {
+  int i;
+  loop->reclaim = 0;
+  for (i = 0; i < loop->npages; i++) {
+    if (!loop->pages[i] || loop->pages[i]->len)
+      continue;
+    if (loop->spare)
+      xfree(loop->spare);
+    loop->spare = loop->pages[i];
+    loop->pages[i] = NULL;
+  }
+}
+
+// fdt_free frees the fd table along with loop::changes and loop::ready.
+static void fdt_free(struct loop *loop) {
+  int i;
+  for (i = 0; i < loop->npages; i++)
+    if (loop->pages[i])
+      xfree(loop->pages[i]);
+  if (loop->pages)
+    xfree(loop->pages);
+  if (loop->spare)
+    xfree(loop->spare);
+  if (loop->changes)
+    xfree(loop->changes);
+  if (loop->ready)
+    xfree(loop->ready);
+}
+
+// struct backend is how an event loop talks to the kernel, every backend
+// available is compiled in, see ev_*.c, and one is picked per event loop
+// by backend_init.
+struct backend {
+  const char *name;
+  int id;  // LOOP_EPOLL, LOOP_URING, etc.
+  int (*init)(struct loop *);
+  void (*free)(struct loop *);
+  // extends the buffers for loop::fired to the given capacity.
+  int (*realloc)(struct loop *, int);
+  // adds, modifies or deletes the registration of an fd, the events of
+  // EV_CTL_DEL are those registered.
+  int (*ctl)(struct loop *, int, int, int);
+  // fills loop::fired and returns the number of fired events.
+  int (*poll)(struct loop *, long long);
+  // submits a struct ev_req, or NULL if it isn't supported.
+  int (*submit)(struct loop *, struct ev_req *);
+};
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && !defined(X_NO_URING)
+#define HAVE_URING
+#endif
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) ||    \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#define HAVE_KQUEUE
+#endif
+
+// fired_set fills a struct ev_fired for the entry 'e' of the fd table.
+static inline void fired_set(struct ev_fired *fired, struct fdent *e,
+                             int events) {
+  fired->e = e;
+  fired->events = events;
+  fired->seq = e->seq;
+}
+
 #include "ev_epoll.c"
-#else
-#ifndef __APPLE__
 #include "ev_kqueue.c"
-#else
+#include "ev_poll.c"
 #include "ev_select.c"
+#include "ev_uring.c"
+
+// backends in the order they are tried unless one is asked for, the
+// first one being the default.
+static const struct backend *backends[] = {
+#if defined(HAVE_URING) && defined(X_USE_URING)
+    &uring_backend,
+#endif
+#ifdef X_USE_POLL
+    &poll_backend,
+#endif
+#ifdef __linux__
+    &epoll_backend,
 #endif
+#ifdef HAVE_KQUEUE
+    &kqueue_backend,
 #endif
+#if defined(HAVE_URING) && !defined(X_USE_URING)
+    &uring_backend,
+#endif
+#ifndef X_USE_POLL
+    &poll_backend,
+#endif
+    &select_backend,
+    NULL,
+};
+
+static inline int api_realloc(struct loop *loop, int cap) {
+  return loop->api->realloc(loop, cap);
+}
+
+static inline int api_ctl(struct loop *loop, int op, int fd, int events) {
+  return loop->api->ctl(loop, op, fd, events);
+}
+
+static inline int api_poll(struct loop *loop, long long timeout) {
+  return loop->api->poll(loop, timeout);
+}
+
+// backend_init picks a backend for the event loop and initializes it. A
+// backend given by flags of loop_alloc_flags must work, or else the one
+// named by $LIBX_BACKEND is tried, and then the others in order, so that
+// a host without e.g. io_uring falls back to the next one.
+static int backend_init(struct loop *loop, int flags) {
+  const struct backend **b;
+  const char *name = getenv("LIBX_BACKEND");
+  int id = flags & LOOP_BACKEND;
+
+  for (b = backends; *b; b++) {
+    if (id ? (*b)->id != id : !name || strcmp((*b)->name, name))
+      continue;
+    loop->api = *b;
+    if (loop->api->init(loop) == 0)
+      return 0;
+    break;
+  }
+  if (id)
+    return -1;
+  for (b = backends; *b; b++) {
+    loop->api = *b;
+    if (loop->api->init(loop) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+#include "ev_wheel.c"
+
+// clock_now returns the monotonic time in nanoseconds, which doesn't jump
+// like the wall-clock time does.
+static inline long long clock_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifndef X_TRACE_SIZE
+#define X_TRACE_SIZE 4096  // records of the trace ring, a power of 2.
+#endif
+
+#ifdef X_TRACE
+static int trace_ids;  // the last loop::trace_id given.
+
+// trace_add appends a record to the trace ring, overwriting the oldest
+// one. Only the thread of the event loop writes it, and it publishes a
+// record by bumping loop::trace_head, which readers check again after
+// copying to leave out records overwritten under them, see loop_trace.
+static inline void trace_add(struct loop *loop, long long ts, int type, int fd,
+                             int arg, int val) {
+  unsigned long long head = loop->trace_head;
+  struct trace_rec *r = &loop->trace[head & (X_TRACE_SIZE - 1)];
+  r->ts = ts;
+  r->type = type;
+  r->fd = fd;
+  r->arg = arg;
+  r->val = val;
+  __atomic_store_n(&loop->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+#else
+// the arguments are not evaluated, so tracing costs nothing at all.
+#define trace_add(loop, ts, type, fd, arg, val) ((void)0)
+#endif
+
+static int wake_init(struct loop *);
+static void wake_free(struct loop *);
+
+struct loop *loop_alloc(int backlog) { return loop_alloc_flags(backlog, 0); }
 
-struct loop *loop_alloc(int backlog) {
+struct loop *loop_alloc_flags(int backlog, int flags) {
   struct loop *loop;
 
   loop = xalloc(NULL, sizeof(struct loop));
@@ -45,27 +402,56 @@ struct loop *loop_alloc(int backlog) {
   if (!loop->fired)
     goto err;
 
-  loop->events = xalloc(NULL, sizeof(struct ev *) * backlog);
-  if (!loop->events)
+  loop->heap = xalloc(NULL, sizeof(struct hnode) * backlog);
+  if (!loop->heap)
     goto err;
 
-  loop->heap = xalloc(NULL, sizeof(struct ev *) * backlog);
-  if (!loop->heap)
+#ifdef X_TRACE
+  loop->trace = xalloc(NULL, sizeof(struct trace_rec) * X_TRACE_SIZE);
+  if (!loop->trace)
     goto err;
+  loop->trace_id = __atomic_add_fetch(&trace_ids, 1, __ATOMIC_RELAXED);
+#endif
 
+  loop->now = clock_now();
+  if (flags & LOOP_WHEEL) {
+    loop->wheel = wheel_alloc(loop->now / NS_PER_MS, backlog);
+    if (!loop->wheel)
+      goto err;
+  }
+
+  loop->flags = flags;
+  loop->done_tail = &loop->done;
+  loop->timer_budget = 1024;
+  loop->timer_free = -1;
+  loop->low_budget = INT_MAX;
+  loop->io_budget = INT_MAX;
+  loop->batch_delay = 100000;
+  loop->heap_cap = backlog;
   loop->cap = backlog;
   loop->len = 0;
 
-  if (api_init(loop) < 0)
+  if (backend_init(loop, flags) < 0)
     goto err;
 
+  if (wake_init(loop) < 0) {
+    loop->api->free(loop);
+    goto err;
+  }
+
   return loop;
 
 err:
+  if (loop && loop->wheel)
+    wheel_free(loop->wheel);
   if (loop && loop->heap)
     xalloc(loop->heap, 0);
-  if (loop && loop->events)
-    xalloc(loop->events, 0);
+#ifdef X_TRACE
+  if (loop && loop->trace)
+    xalloc(loop->trace, 0);
+#endif
+  if (loop)
+    fdt_free(loop);
   if (loop && loop->fired)
     xalloc(loop->fired, 0);
   if (loop)
@@ -73,244 +459,1030 @@ err:
   return NULL;
 }
 
-// less returns 1(0) if 'p' is sooner(later) than 'q'.
-static inline int less(struct ev *p, struct ev *q) {
-  struct timeval *tp = &p->when, *tq = &q->when;
-  return tp->tv_sec < tq->tv_sec ||
-         (tp->tv_sec == tq->tv_sec && tp->tv_usec < tq->tv_usec);
-}
+// The minheap is 4-ary, i.e. children of heap[i] are heap[4i+1..4i+4],
+// which makes it half as deep as a binary one and have the children to
+// compare with adjacent in memory. Sifting moves a hole instead of
+// swapping, and every moved node has its ev::id updated.
+#define HEAP_D 4
 
 // heap_up moves heap[i] upwards.
-static inline void heap_up(struct ev **heap, int i) {
-  struct ev *tmp;
+static inline void heap_up(struct hnode *heap, int i) {
+  struct hnode node = heap[i];
   int j;
-  for (;;) {
-    j = (i - 1) / 2;  // parent
-    if (j == i || less(heap[j], heap[i]))
+  while (i > 0) {
+    j = (i - 1) / HEAP_D;  // parent
+    if (heap[j].when <= node.when)
       break;
-    tmp = heap[i];
     heap[i] = heap[j];
-    heap[j] = tmp;
+    heap[i].ev->id = i;
     i = j;
   }
+  heap[i] = node;
+  node.ev->id = i;
 }
 
-// heap_up moves heap[i] downwards and returns 1(0) if it is(not) moved.
-static inline int heap_down(struct ev **heap, int i, int n) {
-  struct ev *tmp;
-  int t = i, j, j1, j2;
+// heap_down moves heap[i] downwards and returns 1(0) if it is(not) moved.
+static inline int heap_down(struct hnode *heap, int i, int n) {
+  struct hnode node = heap[i];
+  int t = i, j, k, end;
   for (;;) {
-    j1 = 2 * i + 1;  // left child
-    if (j1 >= n)
+    j = HEAP_D * i + 1;  // first child
+    if (j >= n)
       break;
-    j = j1;
-
-    j2 = j1 + 1;  // right child
-    if (j2 < n && less(heap[j2], heap[j1]))
-      j = j2;
-
-    if (less(heap[i], heap[j]))
+    end = j + HEAP_D < n ? j + HEAP_D : n;
+    for (k = j + 1; k < end; k++)  // the closest child
+      if (heap[k].when < heap[j].when)
+        j = k;
+    if (node.when <= heap[j].when)
       break;
-    tmp = heap[i];
     heap[i] = heap[j];
-    heap[j] = tmp;
+    heap[i].ev->id = i;
     i = j;
   }
+  heap[i] = node;
+  node.ev->id = i;
   return i > t;
 }
 
+// heap_fix re-orders the heap after the deadline of heap[i] is changed.
+static inline void heap_fix(struct hnode *heap, int i, int n) {
+  if (!heap_down(heap, i, n))
+    heap_up(heap, i);
+}
+
 // heap_remove removes heap[i] and re-order the heap.
-static struct ev *heap_remove(struct ev **heap, int i, int n) {
-  struct ev *ev = heap[i];
-  if (i != n) {  // if we are not removing the last one.
+static struct ev *heap_remove(struct hnode *heap, int i, int n) {
+  struct ev *ev = heap[i].ev;
+  if (i != n - 1) {  // if we are not removing the last one.
     heap[i] = heap[n - 1];
-    if (!heap_down(heap, i, n))
-      heap_up(heap, i);
+    heap_fix(heap, i, n - 1);
   }
   return ev;
 }
 
 // heap_push pushes 'ev' up to the correct position in the heap.
-static void heap_push(struct ev **heap, struct ev *ev, int n) {
-  heap[n] = ev;
+static void heap_push(struct hnode *heap, struct ev *ev, int n) {
+  heap[n].when = ev->when;
+  heap[n].ev = ev;
   heap_up(heap, n);
 }
 
-// heap_pop pops out heap[0] and re-order the heap.
-static struct ev *heap_pop(struct ev **heap, int n) {
+// timer_add adds a timer event to the minheap or the timing wheel.
+static int timer_add(struct loop *loop, struct ev *ev) {
+  struct hnode *heap;
+  int cap;
+
+  if (loop->wheel) {
+    if (ev == loop->firing)  // re-armed by its own callback.
+      loop->firing = NULL;
+    ev->id = wheel_add(loop->wheel, ev,
+                       (ev->when + NS_PER_MS - 1) / NS_PER_MS);
+    if (unlikely(ev->id < 0))
+      return -1;
+    loop->len++;
+  } else if (ev == loop->firing) {
+    // re-armed by its own callback while it is still on the top of the
+    // minheap, so we sift it down in place rather than pop and push it.
+    loop->firing = NULL;
+    loop->heap[ev->id].when = ev->when;
+    heap_fix(loop->heap, ev->id, loop->len);
+  } else {
+    // the minheap grows with the number of timer events, not with
+    // the file descriptors.
+    if (loop->len >= loop->heap_cap) {
+      cap = loop->heap_cap + loop->heap_cap / 2 + 1;
+      heap = xalloc(loop->heap, sizeof(*heap) * cap);
+      if (unlikely(!heap))
+        return -1;
+      loop->heap = heap;
+      loop->heap_cap = cap;
+    }
+    heap_push(loop->heap, ev, loop->len);
+    loop->len++;
+  }
+  return 0;
+}
+
+// timer_del removes a timer event from the minheap or the timing wheel.
+static void timer_del(struct loop *loop, struct ev *ev) {
+  if (ev == loop->firing)
+    loop->firing = NULL;
+  if (ev->id < 0)  // expired and popped from the timing wheel.
+    return;
+  if (loop->wheel)
+    wheel_del(loop->wheel, ev->id);
+  else
+    heap_remove(loop->heap, ev->id, loop->len);
+  ev->id = -1;
+  loop->len--;
+}
+
+// timer_next saves the time to expire the closest timer event in 'when'
+// and returns 1, or returns 0 if there's no timer event.
+static int timer_next(struct loop *loop, long long *when) {
+  long long ms;
+  if (loop->wheel) {
+    if (!wheel_next(loop->wheel, &ms))
+      return 0;
+    *when = ms * NS_PER_MS;
+    return 1;
+  }
+  if (!loop->len)
+    return 0;
+  *when = loop->heap[0].when;
+  return 1;
+}
+
+// timer_expire returns an expired timer event, or NULL if there's none.
+// An expired timer event is removed from the timing wheel right away,
+// but is left on the top of the minheap until its callback returns, see
+// timer_done.
+static struct ev *timer_expire(struct loop *loop, long long now) {
   struct ev *ev;
-  if (n <= 0)
-    return NULL;
-  ev = heap[0];
-  heap[0] = heap[n - 1];
-  heap_down(heap, 0, n);
-  return ev;
+  if (loop->wheel) {
+    wheel_advance(loop->wheel, now / NS_PER_MS);
+    if ((ev = wheel_pop(loop->wheel)) != NULL) {
+      ev->id = -1;  // avoid duplicated removal by loop_ctl
+      loop->len--;
+    }
+    return loop->firing = ev;
+  }
+  if (loop->len && loop->heap[0].when <= now)
+    return loop->firing = loop->heap[0].ev;
+  return NULL;
 }
 
-int loop_dispatch(struct loop *loop, int flags) {
-  struct timeval now, tv, *ptv = NULL;
+// timer_done removes an expired timer event after its callback returns,
+// or reschedules it from its deadline if it is EV_PERSIST, so that the
+// period doesn't drift by the latency of callbacks. Those re-armed or
+// deleted by their callbacks are left alone.
+static void timer_done(struct loop *loop, struct ev *ev) {
+  long long period;
+
+  if (ev != loop->firing)
+    return;
+  if (!(ev->events & EV_PERSIST) || ev->ms <= 0) {
+    timer_del(loop, ev);
+    return;
+  }
+  period = ev->ms * NS_PER_MS;
+  ev->when += period;
+  if (!(ev->events & EV_CATCHUP) && ev->when <= loop->now)
+    ev->when += ((loop->now - ev->when) / period + 1) * period;
+  timer_add(loop, ev);  // sifted in place on the minheap.
+}
+
+// Registrations of IO events are not changed by loop_ctl right away, an
+// fd whose events are added or modified is queued in loop::changes, and
+// the net result is applied once before the next poll, skipping those
+// whose registered events are unchanged. So an fd flipping EV_WRITE on
+// and off around partial writes costs at most one call per iteration.
+// Deletions are applied right away, since the fd is likely to be closed
+// next, and closing it doesn't remove it from an epoll shared by a dup.
+
+// changes_add queues an fd in loop::changes.
+static int changes_add(struct loop *loop, int fd, struct fdent *e) {
+  int *changes, cap;
+
+  if (e->flags & FDE_QUEUED)
+    return 0;
+  if (loop->nchanges >= loop->changes_cap) {
+    cap = loop->changes_cap + loop->changes_cap / 2 + 16;
+    changes = xalloc(loop->changes, sizeof(*changes) * cap);
+    if (unlikely(!changes))
+      return -1;
+    loop->changes = changes;
+    loop->changes_cap = cap;
+  }
+  loop->changes[loop->nchanges++] = fd;
+  e->flags |= FDE_QUEUED;
+  return 0;
+}
+
+// changes_apply applies the changes queued in loop::changes. A failure,
+// e.g. adding a closed fd, is reported to the callback with all of its
+// IO events fired like an error polled, so that it fails on read or
+// write.
+static int changes_apply(struct loop *loop) {
+  struct fdent *e;
+  struct ev *ev;
+  int i, fd, op, err, status = 0;
+
+  // callbacks called on failures may queue more changes.
+  for (i = 0; i < loop->nchanges; i++) {
+    fd = loop->changes[i];
+    e = fdt_get(loop, fd);
+    e->flags &= ~FDE_QUEUED;
+    if (e->want == e->mask && !(e->flags & FDE_REARM)) {
+      fdt_release(loop, fd);
+      continue;
+    }
+    op = !e->mask ? EV_CTL_ADD : !e->want ? EV_CTL_DEL : EV_CTL_MOD;
+    // an fd added again by another event without being deleted may have
+    // been closed and opened again, which drops its registration from
+    // the kernel, so it is registered anew rather than modified. One
+    // added again by the same event, e.g. to change its events, is only
+    // modified.
+    if (op == EV_CTL_MOD && (e->flags & FDE_READD)) {
+      if (loop->flags & LOOP_STATS)
+        loop->stats.ctl_calls++;
+      api_ctl(loop, EV_CTL_DEL, fd, e->mask);  // fails if it was dropped.
+      op = EV_CTL_ADD;
+    }
+    e->flags &= ~(FDE_REARM | FDE_READD);
+    if (loop->flags & LOOP_STATS)
+      loop->stats.ctl_calls++;
+    if (api_ctl(loop, op, fd, op == EV_CTL_DEL ? e->mask : e->want) < 0 &&
+        op != EV_CTL_DEL && (ev = e->ev) != NULL) {
+      ev->revents = ev->events & EV_IO;
+      if (ev->callback && (err = ev->callback(loop, ev)) < 0 && !status)
+        status = err;
+      continue;
+    }
+    e->mask = e->want;
+    fdt_release(loop, fd);
+  }
+  loop->nchanges = 0;
+  return status;
+}
+
+// hist_add adds a value to a log2-bucketed histogram of struct loop_stats.
+static inline void hist_add(unsigned long long *hist, long long v) {
+  int i = v > 0 ? 64 - __builtin_clzll(v) : 0;
+  hist[i < LOOP_STATS_BUCKETS ? i : LOOP_STATS_BUCKETS - 1]++;
+}
+
+// callback_timed returns non-zero if callbacks are to be timed, for
+// LOOP_STATS or X_TRACE.
+static inline int callback_timed(struct loop *loop) {
+#ifdef X_TRACE
+  return 1;
+#else
+  return loop->flags & LOOP_STATS;
+#endif
+}
+
+// callback_done records the duration of a callback which was called at
+// 't' on 'fd' with 'arg', and returns the time it returned, so that a run
+// of callbacks costs one clock read each.
+static inline long long callback_done(struct loop *loop, long long t, int fd,
+                                      int arg) {
+  long long now = clock_now();
+  if (loop->flags & LOOP_STATS)
+    hist_add(loop->stats.callback_ns, now - t);
+  trace_add(loop, t, TRACE_CALLBACK, fd, arg,
+            now - t < INT_MAX ? now - t : INT_MAX);
+  return now;
+}
+
+// busy_poll polls IO events without blocking for loop::busy_poll, or for
+// 'timeout' if it is shorter, and then blocks for the rest of 'timeout'
+// if none has fired, so that IO events coming in quickly are dispatched
+// without the cost of sleeping and being woken up.
+static int busy_poll(struct loop *loop, long long timeout) {
+  long long now, spin = loop->busy_poll;
+  int n, stats = loop->flags & LOOP_STATS;
+
+  if (timeout >= 0 && timeout < spin)
+    spin = timeout;
+  for (;;) {
+    n = api_poll(loop, 0);
+    if (stats)
+      loop->stats.busy_polls++;
+    if (n || loop->done) {
+      if (stats)
+        loop->stats.busy_hits++;
+      return n;
+    }
+    now = clock_now();
+    if (now - loop->now >= spin)
+      break;
+  }
+  if (timeout >= 0 && (timeout -= now - loop->now) <= 0)
+    return 0;
+  if (stats)
+    loop->stats.busy_blocks++;
+  return api_poll(loop, timeout);
+}
+
+// batch_delay sleeps for loop::batch_delay, or for 'timeout' if it is
+// shorter, before a poll so that IO events coming in at a low rate are
+// collected and dispatched in a batch, and returns what is left of
+// 'timeout'. It is done only after a poll which fired some IO events but
+// fewer than loop::batch, so that an idle loop wakes up without delay.
+static long long batch_delay(struct loop *loop, long long timeout) {
+  struct timespec ts;
+  long long delay = loop->batch_delay, now;
+
+  if (timeout >= 0 && timeout < delay)
+    delay = timeout;
+  ts.tv_sec = delay / 1000000000LL;
+  ts.tv_nsec = delay % 1000000000LL;
+  nanosleep(&ts, NULL);
+  now = clock_now();
+  delay = now - loop->now;
+  loop->now = now;
+  if (loop->flags & LOOP_STATS) {
+    loop->stats.batch_delays++;
+    hist_add(loop->stats.delay_ns, delay);
+  }
+  if (timeout < 0)
+    return timeout;
+  return timeout > delay ? timeout - delay : 0;
+}
+
+// io_budget returns non-zero if IO events can still be dispatched in
+// this iteration, see LOOP_OPT_IO_BUDGET and LOOP_OPT_TIME_BUDGET.
+static inline int io_budget(struct loop *loop) {
+  return loop->io_left > 0 && (!loop->io_until || clock_now() < loop->io_until);
+}
+
+// ready_add queues the events fired on an fd in loop::ready to dispatch
+// them later, events fired again before are merged into fdent::pending.
+static int ready_add(struct loop *loop, int fd, struct fdent *e, int events) {
+  int *ready, cap;
+
+  if (e->pending) {
+    e->pending |= events;
+    return 0;
+  }
+  if (loop->nready >= loop->ready_cap) {
+    cap = loop->ready_cap + loop->ready_cap / 2 + 16;
+    ready = xalloc(loop->ready, sizeof(*ready) * cap);
+    if (unlikely(!ready))
+      return -1;
+    loop->ready = ready;
+    loop->ready_cap = cap;
+  }
+  loop->ready[loop->nready++] = fd;
+  e->pending = events;
+  return 0;
+}
+
+// io_callback calls the callback of the IO event of an fd with the events
+// fired, and returns 1 if it is called, 0 if not, or a negative number
+// returned by it. If the callback calls loop_yield, the events are queued
+// to be dispatched again by a later pass.
+static int io_callback(struct loop *loop, struct fdent *e, int events,
+                       long long *t) {
+  struct ev *ev = e->ev;
+  int err, fd;
+
+  // skip events deleted or turned off by callbacks of this iteration.
+  if (!ev || !(ev->revents = events & e->want) || !ev->callback)
+    return 0;
+  if (!(ev->events & EV_PRIO_HIGH))
+    loop->io_left--;
+  fd = ev->fd;  // ev may be freed by the callback.
+  events = ev->revents;
+  e->flags &= ~FDE_YIELD;
+  err = ev->callback(loop, ev);
+  if (callback_timed(loop))
+    *t = callback_done(loop, *t, fd, events);
+  if (err < 0)
+    return err;
+  // the entry stays put until the dispatch returns, see fdt_release.
+  if (e->flags & FDE_YIELD) {
+    e->flags &= ~FDE_YIELD;
+    if (e->ev != ev)  // deleted or replaced by the callback.
+      return 1;
+    if (unlikely(ready_add(loop, fd, e, events) < 0))
+      return -1;
+    if (loop->flags & LOOP_STATS)
+      loop->stats.yields++;
+  }
+  return 1;
+}
+
+// ready_dispatch dispatches the events queued in loop::ready of either
+// EV_PRIO_LOW or not, no more than 'max' of them and the budget of this
+// iteration, and leaves the rest in it in order. Those queued again by
+// callbacks are left to the next pass.
+static int ready_dispatch(struct loop *loop, int low, int max, long long *t) {
+  struct fdent *e;
+  int i, j, n, fd, events, polled = 0, len = loop->nready;
+
+  for (i = j = 0; i < len; i++) {
+    fd = loop->ready[i];
+    // drop an entry freed, or whose pending events are dropped by
+    // loop_del.
+    if (!(e = fdt_get(loop, fd)) || !e->pending || !e->ev)
+      continue;
+    if (!(e->ev->events & EV_PRIO_LOW) != !low || polled >= max ||
+        polled < 0 ||
+        (!(e->ev->events & EV_PRIO_HIGH) && !io_budget(loop))) {
+      loop->ready[j++] = fd;
+      continue;
+    }
+    events = e->pending;
+    e->pending = 0;
+    if ((n = io_callback(loop, e, events, t)) < 0)
+      polled = n;  // keep the rest in order before returning it.
+    else
+      polled += n;
+  }
+  // move those queued by callbacks down after the ones left.
+  memmove(loop->ready + j, loop->ready + len,
+          sizeof(int) * (loop->nready - len));
+  loop->nready = j + loop->nready - len;
+  return polled;
+}
+
+static int __dispatch(struct loop *loop, int flags) {
+  long long t, when, timeout = -1;
+  struct ev_req *req;
   struct ev *tev = NULL;
-  struct ev *event = NULL;
   struct ev_fired *fired = NULL;
-  int i, err, nevents, polled = 0;
+  struct fdent *e;
+  int i, j, err, nevents, queued, delayed, fd, res, polled = 0;
+  int stats = loop->flags & LOOP_STATS, timed = callback_timed(loop);
 
   // a zero flag means the caller doesn't want to dispatch
   // any event, so we return right away.
   if (!flags)
     return 0;
 
-  // see if or not the caller wants to dispatch a timer event.
-  // if not, we go for IO events.
-  if (!(flags & EV_TIMER))
-    goto do_io;
+  // update the cached time once per iteration, timer events added
+  // by callbacks are based on it.
+  loop->now = clock_now();
+  t = loop->now;
+  if (stats)
+    loop->stats.iterations++;
 
-  // get the current time in microseconds.
-  if (unlikely(gettimeofday(&now, NULL) < 0))
-    return -1;
+  // peek the closest timer event, if there's one then we use
+  // its timeout interval to timeout the polling of IO events,
+  // and if it has already expired, we only poll IO events that
+  // are ready without blocking.
+  if ((flags & EV_TIMER) && timer_next(loop, &when)) {
+    // wake up on a multiple of the slack rather than on the closest
+    // deadline, so that timer events due in between fire together.
+    if (loop->slack)
+      when = (when + loop->slack - 1) / loop->slack * loop->slack;
+    timeout = when > loop->now ? when - loop->now : 0;
+  }
 
-  // poll the closest timer event, if there's one then we use
-  // its timeout interval to timeout the polling of IO events
-  if ((tev = heap_pop(loop->heap, loop->len)) != NULL) {
-    tv.tv_sec = tev->when.tv_sec - now.tv_sec;
-    tv.tv_usec = tev->when.tv_usec - now.tv_usec;
-    ptv = &tv;
-    loop->len--;
-    tev->id = -1;  // avoid duplicated removal by loop_ctl
-  }
-
-  // if the closest timer event we just polled out reaches or
-  // exceeds its timeout interval, we must go dispatch it
-  // immediately, leaving the IO events to the next call to
-  // loop_dispatch.
-  // PS: if "tv_usec" is 900, adding 999 and then dividing by
-  // 1000 will give a result of 1, which is the nearest millisecond.
-  // if we simply divide by 1000 without adding 999, the result
-  // would be 0, which is incorrect.
-  if (ptv && ptv->tv_sec * 1000 + (ptv->tv_usec + 999) / 1000 <= 0)
+  // go for timer events if the caller doesn't want to dispatch
+  // IO events.
+  if (!(flags & EV_READ) && !(flags & EV_WRITE))
     goto do_timer;
 
-do_io:
-  // if the caller doesn't want to dispatch IO events either,
-  // we return right away.
-  if (!(flags & EV_READ) && !(flags & EV_WRITE))
-    return 0;
+  // IO events left by the last iteration are ready already.
+  if (loop->nready)
+    timeout = 0;
 
   // poll fired IO events with the timeout interval of the closest
   // timer event we just calculated.
-  nevents = api_poll(loop, ptv);
+  if (loop->nchanges && (err = changes_apply(loop)) < 0)
+    return err;
+  delayed = 0;
+  if (loop->batch && timeout && loop->last_events &&
+      loop->last_events < loop->batch && !loop->done) {
+    timeout = batch_delay(loop, timeout);
+    t = loop->now;  // the delay is counted apart from polling.
+    delayed = 1;
+  }
+  trace_add(loop, clock_now(), TRACE_POLL_ENTER, -1,
+            timeout < 0 ? -1 : timeout / 1000 < INT_MAX ? timeout / 1000
+                                                        : INT_MAX,
+            0);
+  if (loop->busy_poll && timeout)
+    nevents = busy_poll(loop, timeout);
+  else
+    nevents = api_poll(loop, timeout);
+  loop->last_events = nevents;
+  loop->now = clock_now();
+  trace_add(loop, loop->now, TRACE_POLL_EXIT, -1, nevents, 0);
+  if (stats) {
+    hist_add(loop->stats.poll_ns, loop->now - t);
+    hist_add(loop->stats.events, nevents);
+    if (delayed && nevents >= loop->batch)
+      loop->stats.batch_hits++;
+  }
+  t = loop->now;
+
+  // start the budget of this iteration for IO events.
+  loop->io_left = loop->io_budget;
+  loop->io_until = loop->time_budget ? loop->now + loop->time_budget : 0;
+  queued = loop->nready;
+
+  // dispatch fired IO events of EV_PRIO_HIGH to their callback
+  // functions first, regardless of the budget, queue those of
+  // EV_PRIO_LOW or already queued to be dispatched after timer
+  // events, and keep the others in loop::fired.
+  for (i = j = 0; i < nevents; i++) {
+    fired = &loop->fired[i];
+    e = fired->e;
+    if (!e->ev || e->seq != fired->seq)  // deleted by a callback.
+      continue;
+    if ((e->ev->events & EV_PRIO_LOW) || e->pending) {
+      if (unlikely(ready_add(loop, e->ev->fd, e, fired->events) < 0))
+        return -1;
+    } else if (!(e->ev->events & EV_PRIO_HIGH)) {
+      loop->fired[j++] = *fired;
+    } else {
+      if ((err = io_callback(loop, e, fired->events, &t)) < 0)
+        return err;
+      polled += err;
+    }
+  }
 
-  // dispatch fired IO events to their callback functions.
-  for (i = 0; i < nevents; i++) {
+  // dispatch the other fired IO events to their callback functions
+  // within the budget, or queue them behind those left by the last
+  // iteration so that every fd gets its turn.
+  for (i = 0; i < j; i++) {
     fired = &loop->fired[i];
-    event = loop->events[fired->fd];
-    event->revents = fired->events;
-    if (event->callback) {
-      if ((err = event->callback(loop, event)) < 0)
+    e = fired->e;
+    if (!e->ev || e->seq != fired->seq)
+      continue;
+    if (queued || !io_budget(loop)) {
+      if (unlikely(ready_add(loop, e->ev->fd, e, fired->events) < 0))
+        return -1;
+      continue;
+    }
+    if ((err = io_callback(loop, e, fired->events, &t)) < 0)
+      return err;
+    polled += err;
+  }
+
+  // dispatch completed requests to their callback functions.
+  while ((req = loop->done) != NULL) {
+    if (!(loop->done = req->next))
+      loop->done_tail = &loop->done;
+    loop->len_req--;
+    if (req->callback) {
+      fd = req->fd;  // req may be freed by the callback.
+      res = req->res;
+      err = req->callback(loop, req);
+      if (timed)
+        t = callback_done(loop, t, fd, res);
+      if (err < 0)
         return err;
       polled++;
     }
   }
 
 do_timer:
-  if (tev && tev->callback) {
-    tev->revents = EV_TIMER;
-    if ((err = tev->callback(loop, tev)) < 0)
+  if (flags & EV_TIMER) {
+    // dispatch all the expired timer events, but no more than the
+    // budget so that a burst of them can't starve IO events, the
+    // rest is left to the next iteration which polls IO events
+    // without blocking.
+    for (i = 0; i < loop->timer_budget; i++) {
+      if (!(tev = timer_expire(loop, loop->now)))
+        break;
+      if (!tev->callback) {
+        timer_done(loop, tev);
+        continue;
+      }
+      tev->revents = EV_TIMER;
+      if (stats)
+        hist_add(loop->stats.lateness_ns, t - tev->when);
+      fd = tev->fd;  // the timer of a timeout queue may be freed by now.
+      err = tev->callback(loop, tev);
+      if (timed)
+        t = callback_done(loop, t, fd, EV_TIMER);
+      timer_done(loop, tev);
+      if (err < 0)
+        return err;
+      // remove the event from the kernel if it is also an IO event,
+      // unless it is EV_PERSIST and still scheduled.
+      if (fd > 0 && (e = fdt_get(loop, fd)) && e->ev == tev &&
+          e->mask && !((tev->events & EV_PERSIST) && tev->id >= 0)) {
+        api_ctl(loop, EV_CTL_DEL, tev->fd, e->mask);
+        e->mask = e->want = 0;
+      }
+      polled++;
+    }
+  }
+
+  // dispatch IO events queued by the passes above or left by the last
+  // iteration within the budget, and those of EV_PRIO_LOW last but no
+  // more than their own budget so that a flood of them can't delay the
+  // others. The rest is left to the next iteration.
+  if ((flags & EV_IO) && loop->nready) {
+    if ((err = ready_dispatch(loop, 0, INT_MAX, &t)) < 0)
       return err;
-    if (tev->fd > 0)  // remove the event if it is also an IO event.
-      api_ctl(loop, EV_CTL_DEL, tev->fd, tev->events);
-    polled++;
+    polled += err;
+    if ((err = ready_dispatch(loop, 1, loop->low_budget, &t)) < 0)
+      return err;
+    polled += err;
+    if (stats)
+      loop->stats.deferred += loop->nready;
   }
   return polled;
 }
 
+long long loop_now(struct loop *loop) { return loop->now; }
+
+const char *loop_backend(struct loop *loop) { return loop->api->name; }
+
+int loop_stats(struct loop *loop, struct loop_stats *stats) {
+  if (!(loop->flags & LOOP_STATS))
+    return -1;
+  memcpy(stats, &loop->stats, sizeof(*stats));
+  return 0;
+}
+
+#ifdef X_TRACE
+int loop_trace(struct loop *loop, struct trace_rec *recs, int n) {
+  unsigned long long head, tail, i;
+
+  if (n <= 0)
+    return 0;
+  if (n > X_TRACE_SIZE)
+    n = X_TRACE_SIZE;
+  head = __atomic_load_n(&loop->trace_head, __ATOMIC_ACQUIRE);
+  tail = head > (unsigned)n ? head - n : 0;
+  for (i = tail; i < head; i++)
+    recs[i - tail] = loop->trace[i & (X_TRACE_SIZE - 1)];
+  // the record being added overwrites the one X_TRACE_SIZE before it,
+  // so those from there on which were copied may be torn.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  i = __atomic_load_n(&loop->trace_head, __ATOMIC_RELAXED) + 1;
+  if (i > X_TRACE_SIZE && i - X_TRACE_SIZE > tail) {
+    i -= X_TRACE_SIZE;
+    if (i >= head)
+      return 0;
+    memmove(recs, recs + (i - tail), sizeof(*recs) * (head - i));
+    tail = i;
+  }
+  return head - tail;
+}
+
+void loop_trace_add(struct loop *loop, int type, int fd, int arg) {
+  trace_add(loop, clock_now(), type, fd, arg, 0);
+}
+
+// trace_buf buffers the output of loop_trace_dump.
+struct trace_buf {
+  int fd;
+  int len;
+  char buf[4096];
+};
+
+static int trace_flush(struct trace_buf *b) {
+  int n, off = 0;
+  while (off < b->len) {
+    if ((n = write(b->fd, b->buf + off, b->len - off)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    off += n;
+  }
+  b->len = 0;
+  return 0;
+}
+
+static int trace_printf(struct trace_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int trace_printf(struct trace_buf *b, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (b->len > (int)sizeof(b->buf) - 256 && trace_flush(b) < 0)
+    return -1;
+  va_start(ap, fmt);
+  n = vsnprintf(b->buf + b->len, sizeof(b->buf) - b->len, fmt, ap);
+  va_end(ap);
+  if (n >= (int)sizeof(b->buf) - b->len)
+    n = sizeof(b->buf) - b->len - 1;  // truncated, never happens.
+  b->len += n;
+  return 0;
+}
+
+static const char *trace_name(struct trace_rec *r) {
+  static const char *names[] = {
+      "?",        "poll_enter", "poll_exit", "callback",
+      "ctl",      "bio_read",   "bio_write", "bio_flush",
+  };
+  static const char *ops[] = {"ctl", "ctl_add", "ctl_del", "ctl_mod"};
+
+  if (r->type == TRACE_CTL && r->arg >= 0 && r->arg < 4)
+    return ops[r->arg];
+  if (r->type <= 0 || r->type > TRACE_BIO_FLUSH)
+    return names[0];
+  return names[r->type];
+}
+
+// trace_chrome writes a record as an event of the Trace Event Format,
+// polls are begin and end events, callbacks complete events with their
+// duration, and the rest instant events, all in microseconds.
+static int trace_chrome(struct trace_buf *b, struct trace_rec *r, int pid,
+                        int tid, int first) {
+  const char *ph = "i";
+  const char *name = trace_name(r);
+  const char *key = "arg";
+
+  switch (r->type) {
+  case TRACE_POLL_ENTER:
+    ph = "B", name = "poll", key = "timeout_us";
+    break;
+  case TRACE_POLL_EXIT:
+    ph = "E", name = "poll", key = "events";
+    break;
+  case TRACE_CALLBACK:
+    ph = "X", key = "revents";
+    break;
+  case TRACE_CTL:
+    key = "events";
+    break;
+  default:
+    key = "bytes";
+  }
+  if (trace_printf(b,
+                   "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,"
+                   "\"tid\":%d,\"ts\":%lld.%03lld",
+                   first ? "" : ",\n", name, ph, pid, tid, r->ts / 1000,
+                   r->ts % 1000) < 0)
+    return -1;
+  if (r->type == TRACE_CALLBACK &&
+      trace_printf(b, ",\"dur\":%d.%03d", r->val / 1000, r->val % 1000) < 0)
+    return -1;
+  if (*ph == 'i' && trace_printf(b, ",\"s\":\"t\"") < 0)  // of the thread.
+    return -1;
+  return trace_printf(b, ",\"args\":{\"fd\":%d,\"%s\":%d}}", r->fd, key,
+                      r->type == TRACE_CTL ? r->val : r->arg);
+}
+
+// trace_perf writes a record as a line like `perf script` prints for a
+// tracepoint, which tools reading its output take.
+static int trace_perf(struct trace_buf *b, struct trace_rec *r, int pid,
+                      int tid) {
+  if (trace_printf(b, "libx %d/%d [000] %lld.%06lld: libx:%s: fd=%d", pid, tid,
+                   r->ts / 1000000000LL, r->ts / 1000 % 1000000,
+                   trace_name(r), r->fd) < 0)
+    return -1;
+  switch (r->type) {
+  case TRACE_POLL_ENTER:
+    return trace_printf(b, " timeout_us=%d\n", r->arg);
+  case TRACE_POLL_EXIT:
+    return trace_printf(b, " events=%d\n", r->arg);
+  case TRACE_CALLBACK:
+    return trace_printf(b, " revents=%d dur_ns=%d\n", r->arg, r->val);
+  case TRACE_CTL:
+    return trace_printf(b, " events=%d\n", r->val);
+  default:
+    return trace_printf(b, " bytes=%d\n", r->arg);
+  }
+}
+
+int loop_trace_dump(struct loop *loop, int fd, int format) {
+  struct trace_rec *recs, r;
+  struct trace_buf *b;
+  int i, j, n, pid = getpid(), err = -1;
+
+  if (format != TRACE_CHROME && format != TRACE_PERF)
+    return -2;
+  recs = xalloc(NULL, sizeof(*recs) * X_TRACE_SIZE);
+  b = xalloc(NULL, sizeof(*b));
+  if (unlikely(!recs || !b))
+    goto out;
+  b->fd = fd;
+  b->len = 0;
+  n = loop_trace(loop, recs, X_TRACE_SIZE);
+  // a callback is added when it returns, after the records added by it,
+  // so sort them by time, which takes little as they are nearly sorted.
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && recs[j - 1].ts > recs[j].ts; j--) {
+      r = recs[j];
+      recs[j] = recs[j - 1];
+      recs[j - 1] = r;
+    }
+  }
+  if (format == TRACE_CHROME && trace_printf(b, "{\"traceEvents\":[\n") < 0)
+    goto out;
+  for (i = 0; i < n; i++) {
+    if (format == TRACE_CHROME
+            ? trace_chrome(b, &recs[i], pid, loop->trace_id, i == 0) < 0
+            : trace_perf(b, &recs[i], pid, loop->trace_id) < 0)
+      goto out;
+  }
+  if (format == TRACE_CHROME && trace_printf(b, "\n]}\n") < 0)
+    goto out;
+  err = trace_flush(b);
+out:
+  if (recs)
+    xalloc(recs, 0);
+  if (b)
+    xalloc(b, 0);
+  return err;
+}
+#else
+int loop_trace(struct loop *loop, struct trace_rec *recs, int n) { return -1; }
+
+int loop_trace_dump(struct loop *loop, int fd, int format) { return -1; }
+
+void loop_trace_add(struct loop *loop, int type, int fd, int arg) {}
+#endif
+
+int loop_dispatch(struct loop *loop, int flags) {
+  int polled;
+  loop->dispatching = 1;
+  polled = __dispatch(loop, flags);
+  loop->dispatching = 0;
+  if (loop->reclaim)
+    fdt_reclaim(loop);
+  return polled;
+}
+
+int loop_submit(struct loop *loop, struct ev_req *req) {
+  int status;
+  if (!loop->api->submit) {
+    errno = ENOSYS;
+    return -1;
+  }
+  if (unlikely((status = loop->api->submit(loop, req)) < 0))
+    return status;
+  loop->len_req++;
+  return 0;
+}
+
+int loop_setopt(struct loop *loop, int opt, long long val) {
+  switch (opt) {
+  case LOOP_OPT_TIMER_BUDGET:
+    if (val <= 0 || val > INT_MAX)
+      return -1;
+    loop->timer_budget = val;
+    return 0;
+  case LOOP_OPT_BUSY_POLL:
+    if (val < 0 || val > LLONG_MAX / 1000)
+      return -1;
+    loop->busy_poll = val * 1000;
+    return 0;
+  case LOOP_OPT_LOW_BUDGET:
+    if (val <= 0 || val > INT_MAX)
+      return -1;
+    loop->low_budget = val;
+    return 0;
+  case LOOP_OPT_IO_BUDGET:
+    if (val <= 0 || val > INT_MAX)
+      return -1;
+    loop->io_budget = val;
+    return 0;
+  case LOOP_OPT_TIME_BUDGET:
+    if (val < 0 || val > LLONG_MAX / 1000)
+      return -1;
+    loop->time_budget = val * 1000;
+    return 0;
+  case LOOP_OPT_BATCH:
+    if (val < 0 || val > INT_MAX)
+      return -1;
+    loop->batch = val;
+    return 0;
+  case LOOP_OPT_BATCH_DELAY:
+    if (val <= 0 || val > LLONG_MAX / 1000)
+      return -1;
+    loop->batch_delay = val * 1000;
+    return 0;
+  case LOOP_OPT_SLACK:
+    if (val < 0 || val > LLONG_MAX / 1000)
+      return -1;
+    loop->slack = val * 1000;
+    return 0;
+  default:
+    return -2;  // :(
+  }
+}
+
 int loop_wait(struct loop *loop) {
   int polled = 0, n;
-  while (loop->len + loop->len_io) {
-    if ((n = loop_dispatch(loop, EV_ALL)) < 0)
-      return n;
+  while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE) &&
+         loop->len + loop->len_io + loop->len_req) {
+    if ((n = loop_dispatch(loop, EV_ALL)) < 0) {
+      polled = n;
+      break;
+    }
     polled += n;
   }
+  __atomic_store_n(&loop->stop, 0, __ATOMIC_RELAXED);
   return polled;
 }
 
-static inline int __realloc(struct loop *loop, int cap) {
+// __reserve extends loop::fired and the buffers of the backend if needed
+// so that a poll can fire 'n' events. They grow with the number of IO
+// events, not with file descriptors.
+static int __reserve(struct loop *loop, int n) {
   struct ev_fired *fired;
-  struct ev **events, **heap;
-
+  int status, cap = loop->cap;
+  if (n <= cap)
+    return 0;
+  while (n > cap)
+    cap = cap + cap / 2 + 1;  // 1.5x the current capacity
   fired = xalloc(loop->fired, sizeof(*fired) * cap);
   if (unlikely(!fired))
     return -1;
-
-  events = xalloc(loop->events, sizeof(*events) * cap);
-  if (unlikely(!events))
-    return -1;
-
-  heap = xalloc(loop->heap, sizeof(*heap) * cap);
-  if (unlikely(!heap))
-    return -1;
-
   loop->fired = fired;
-  loop->events = events;
-  loop->heap = heap;
+  status = api_realloc(loop, cap);
+  if (unlikely(status < 0))
+    return status;
+  loop->cap = cap;
   return 0;
 }
 
+// io_flags_ok returns non-zero if the flags of an IO event go together,
+// or sets errno to EINVAL. epoll refuses EPOLLEXCLUSIVE with EPOLLONESHOT.
+static inline int io_flags_ok(int events) {
+  if ((events & EV_EXCLUSIVE) && (events & EV_ONCE)) {
+    errno = EINVAL;
+    return 0;
+  }
+  return 1;
+}
+
 int loop_ctl(struct loop *loop, int op, struct ev *ev) {
-  struct timeval now;
-  int status, cap;
+  struct fdent *e;
+  int status;
+
+  trace_add(loop, clock_now(), TRACE_CTL, ev->fd, op, ev->events);
 
   switch (op) {
   case EV_CTL_ADD:
-    // extend the event loop if needed.
-    if (loop->maxfd >= loop->cap) {
-      cap = loop->cap + loop->cap / 2;  // 1.5x the current capacity
-      status = __realloc(loop, cap);
-      if (unlikely(status < 0))
-        return status;
-      status = api_realloc(loop, cap);
-      if (unlikely(status < 0))
-        return status;
-      loop->cap = cap;
-    }
-    // add ev to the kernel if it is an IO event.
+    // add ev to the fd table and the kernel if it is an IO event.
     if (ev->events & EV_IO) {
-      status = api_ctl(loop, EV_CTL_ADD, ev->fd, ev->events);
+      if (unlikely(ev->fd < 0)) {  // e.g. a failed tcp_listen.
+        errno = EBADF;
+        return -1;
+      }
+      if (unlikely(!io_flags_ok(ev->events)))
+        return -1;
+      status = __reserve(loop, loop->len_io + 1);
       if (unlikely(status < 0))
         return status;
-      loop->len_io++;
+      if (unlikely(!(e = fdt_alloc(loop, ev->fd))))
+        return -1;
+      if (unlikely(changes_add(loop, ev->fd, e) < 0)) {
+        fdt_release(loop, ev->fd);  // reclaim the page if it is new.
+        return -1;
+      }
+      if (!e->ev)
+        loop->len_io++;
+      if (e->mask && e->ev != ev) {  // not deleted, see changes_apply.
+        e->flags |= FDE_REARM | FDE_READD;
+        e->seq++;
+      } else if (e->mask && (ev->events & EV_ONCE)) {
+        e->flags |= FDE_REARM;  // like EV_CTL_MOD.
+      }
+      e->ev = ev;
+      e->want = ev->events & FDE_EVENTS;
+      if (loop->maxfd < ev->fd)
+        loop->maxfd = ev->fd;
     }
-    if (loop->maxfd < ev->fd)
-      loop->maxfd = ev->fd;
-    // add ev to the minimal heap if it is a timeout event.
+    // add ev to the timer engine if it is a timeout event.
     if (ev->events & EV_TIMER) {
-      if (ev->ms) {
-        status = gettimeofday(&now, NULL);
-        if (unlikely(status < 0))
-          return status;
-        ev->when.tv_sec = now.tv_sec + ev->ms / 1000;
-        ev->when.tv_usec = now.tv_usec + ev->ms % 1000 * 1000;
-      }
-      heap_push(loop->heap, ev, loop->len);
-      loop->len++;
+      // callbacks share the time cached by loop_dispatch, others
+      // can't tell how stale it is.
+      if (!loop->dispatching)
+        loop->now = clock_now();
+      if (ev->ms)
+        ev->when = loop->now + ev->ms * NS_PER_MS;
+      status = timer_add(loop, ev);
+      if (unlikely(status < 0))
+        return status;
     }
-    // save ev in the event loop.
-    loop->events[ev->fd] = ev;
+    if (loop->flags & LOOP_STATS)
+      loop->stats.ctl_add++;
     return 0;  // we are good to go :)
 
-  case EV_CTL_DEL:
-    // remove ev from the kernel if it is an IO event.
-    if (ev->events & EV_IO)
-      status = api_ctl(loop, op, ev->fd, ev->events);
-    // remove ev from the minimal heap if it is a timeout event.
-    if ((ev->events & EV_TIMER) && ev->id >= 0) {
-      heap_remove(loop->heap, ev->id, loop->len);
-      loop->len--;
+  case EV_CTL_MOD:
+    // modify the events watched by the kernel, e.g. to re-arm an
+    // IO event with EV_ONCE.
+    if (ev->events & EV_IO) {
+      if (unlikely(!(e = fdt_get(loop, ev->fd)) || !e->ev))
+        return -2;
+      if (unlikely(!io_flags_ok(ev->events)))
+        return -1;
+      if (unlikely(changes_add(loop, ev->fd, e) < 0))
+        return -1;
+      e->ev = ev;
+      e->want = ev->events & FDE_EVENTS;
+      if (ev->events & EV_ONCE)  // re-armed even if unchanged.
+        e->flags |= FDE_REARM;
     }
-    // remove ev from the event loop anyways.
-    if (op == EV_CTL_DEL) {
-      loop->events[ev->fd] = NULL;
+    if (loop->flags & LOOP_STATS)
+      loop->stats.ctl_mod++;
+    return 0;
+
+  case EV_CTL_DEL:
+    // remove ev from the kernel and the fd table if it is an IO event.
+    if ((ev->events & EV_IO) && (e = fdt_get(loop, ev->fd)) && e->ev) {
+      if (e->mask) {
+        if (loop->flags & LOOP_STATS)
+          loop->stats.ctl_calls++;
+        api_ctl(loop, op, ev->fd, e->mask);
+      }
+      e->ev = NULL;
+      e->mask = e->want = e->pending = 0;
+      e->seq++;  // drops the events fired for it but not dispatched yet.
+      fdt_release(loop, ev->fd);
       loop->len_io--;
     }
+    // remove ev from the timer engine if it is a timeout event.
+    if (ev->events & EV_TIMER)
+      timer_del(loop, ev);
+    if (loop->flags & LOOP_STATS)
+      loop->stats.ctl_del++;
     return 0;
 
   default:
@@ -318,10 +1490,446 @@ int loop_ctl(struct loop *loop, int op, struct ev *ev) {
   }
 }
 
+// struct tqnode is a slot of a timeout queue, linked to the previous and
+// the next ones by indexes so that the slots can be reallocated.
+struct tqnode {
+  struct ev *ev;
+  int prev;
+  int next;  // or the next free slot.
+};
+
+struct tq {
+  struct ev timer;        // times out the head of the queue.
+  struct loop *loop;
+  long long ns;           // the timeout of the queue in nanoseconds.
+  struct tqnode *nodes;
+  int cap;                // the number of slots allocated for tq::nodes.
+  int head;               // the first slot in the queue, or -1.
+  int tail;               // the last slot in the queue, or -1.
+  int free;               // the first free slot, or -1.
+  int flags;              // TQ_EXPIRING, TQ_FREED.
+};
+
+#define TQ_EXPIRING (1 << 0)  // its events are being timed out.
+#define TQ_FREED    (1 << 1)  // freed by a callback, see tq_free.
+
+// tq_has returns non-zero if 'ev' is in the queue, ev::id is the slot of
+// an event in the queue, and may be garbage for others.
+static inline int tq_has(struct tq *tq, struct ev *ev) {
+  return ev->id >= 0 && ev->id < tq->cap && tq->nodes[ev->id].ev == ev;
+}
+
+// tq_unlink removes the slot of 'ev' from the queue and frees it.
+static void tq_unlink(struct tq *tq, struct ev *ev) {
+  struct tqnode *n = &tq->nodes[ev->id];
+
+  if (n->prev < 0)
+    tq->head = n->next;
+  else
+    tq->nodes[n->prev].next = n->next;
+  if (n->next < 0)
+    tq->tail = n->prev;
+  else
+    tq->nodes[n->next].prev = n->prev;
+  n->ev = NULL;
+  n->next = tq->free;
+  tq->free = ev->id;
+  ev->id = -1;
+}
+
+// tq_arm adds the timer of the queue to the event loop to fire at the
+// deadline of the head.
+static int tq_arm(struct tq *tq) {
+  tq->timer.when = tq->nodes[tq->head].ev->when;
+  return loop_ctl(tq->loop, EV_CTL_ADD, &tq->timer);
+}
+
+// tq_expire is the callback of the timer of a queue, it times out the
+// expired events at the head, no more than the timer budget of the loop.
+// Events reset after the timer is armed are only moved to the tail, so
+// the timer may find the head not expired yet, then it is re-armed with
+// the deadline of the new head, which is how a reset avoids the timer
+// engine altogether.
+static int tq_expire(struct loop *loop, struct ev *timer) {
+  struct tq *tq = container_of(timer, struct tq, timer);
+  struct ev *ev;
+  int i, err = 0;
+
+  tq->flags |= TQ_EXPIRING;
+  for (i = 0; i < loop->timer_budget && tq->head >= 0; i++) {
+    ev = tq->nodes[tq->head].ev;
+    if (ev->when > loop->now)
+      break;
+    tq_unlink(tq, ev);
+    if (!ev->callback)
+      continue;
+    ev->revents = EV_TIMER;
+    if ((err = ev->callback(loop, ev)) < 0 || (tq->flags & TQ_FREED))
+      break;
+  }
+  tq->flags &= ~TQ_EXPIRING;
+  if (tq->flags & TQ_FREED) {
+    tq_free(tq);
+    return err;
+  }
+  // re-armed in place by its own callback, or removed by timer_done.
+  if (tq->head >= 0 && (i = tq_arm(tq)) < 0 && err >= 0)
+    err = i;
+  return err;
+}
+
+struct tq *tq_alloc(struct loop *loop, long long ms) {
+  struct tq *tq;
+
+  if (unlikely(ms <= 0))
+    return NULL;
+  if (unlikely(!(tq = xalloc(NULL, sizeof(*tq)))))
+    return NULL;
+  memset(tq, 0, sizeof(*tq));
+  tq->timer.fd = -1;
+  tq->timer.events = EV_TIMER;
+  tq->timer.callback = tq_expire;
+  tq->timer.id = -1;
+  tq->loop = loop;
+  tq->ns = ms * NS_PER_MS;
+  tq->head = tq->tail = tq->free = -1;
+  return tq;
+}
+
+int tq_add(struct tq *tq, struct ev *ev) {
+  struct loop *loop = tq->loop;
+  struct tqnode *nodes;
+  int i, cap, empty;
+
+  // callbacks share the time cached by loop_dispatch, others can't
+  // tell how stale it is.
+  if (!loop->dispatching)
+    loop->now = clock_now();
+  ev->when = loop->now + tq->ns;
+  if (tq_has(tq, ev)) {
+    if (ev->id == tq->tail)  // reset right after the last one.
+      return 0;
+    tq_unlink(tq, ev);
+  }
+  if (tq->free < 0) {
+    cap = tq->cap + tq->cap / 2 + 16;
+    nodes = xalloc(tq->nodes, sizeof(*nodes) * cap);
+    if (unlikely(!nodes))
+      return -1;
+    for (i = cap - 1; i >= tq->cap; i--) {
+      nodes[i].ev = NULL;
+      nodes[i].next = tq->free;
+      tq->free = i;
+    }
+    tq->nodes = nodes;
+    tq->cap = cap;
+  }
+  i = tq->free;
+  tq->free = tq->nodes[i].next;
+  tq->nodes[i].ev = ev;
+  tq->nodes[i].prev = tq->tail;
+  tq->nodes[i].next = -1;
+  empty = tq->head < 0;
+  if (empty)
+    tq->head = i;
+  else
+    tq->nodes[tq->tail].next = i;
+  tq->tail = i;
+  ev->id = i;
+  // the timer is left armed while the queue is expiring, which re-arms
+  // it after.
+  if (empty && tq->timer.id < 0 && loop->firing != &tq->timer)
+    return tq_arm(tq);
+  return 0;
+}
+
+void tq_del(struct tq *tq, struct ev *ev) {
+  if (tq_has(tq, ev))
+    tq_unlink(tq, ev);
+}
+
+// tq_free called by a callback of the queue only marks it, the queue is
+// freed once tq_expire is done with it.
+void tq_free(struct tq *tq) {
+  loop_ctl(tq->loop, EV_CTL_DEL, &tq->timer);
+  if (tq->flags & TQ_EXPIRING) {
+    tq->flags |= TQ_FREED;
+    return;
+  }
+  if (tq->nodes)
+    xfree(tq->nodes);
+  xfree(tq);
+}
+
+// Standalone timers are slots of pages of TIMER_PAGE struct timer owned by
+// the event loop, which never move so that the minheap and the timing
+// wheel can point to them, and they grow with the number of timers rather
+// than with the fd table. A handle is the index of a slot and its
+// generation, which is bumped once the slot is freed, so a stale handle
+// of a stopped or fired timer is refused rather than hitting a new one.
+#define TIMER_BITS 10
+#define TIMER_PAGE (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_PAGE - 1)
+
+struct timer {
+  struct ev ev;  // ev::ud is the argument of fn.
+  int (*fn)(struct loop *, void *);
+  unsigned gen;  // generation of the slot, never zero.
+  int next;      // the next free slot or -1, or its own slot if used.
+};
+
+static int timer_fire(struct loop *, struct ev *);
+
+// timer_get returns the timer of a handle, or NULL if it is stale.
+static struct timer *timer_get(struct loop *loop, long long id) {
+  struct timer *t;
+  long long i = id & 0xffffffffLL;
+
+  if (unlikely(id <= 0 || (i >> TIMER_BITS) >= loop->ntimers))
+    return NULL;
+  t = &loop->timers[i >> TIMER_BITS][i & TIMER_MASK];
+  if (t->gen != (unsigned)(id >> 32) || t->ev.callback != timer_fire)
+    return NULL;
+  return t;
+}
+
+// timer_put frees the slot of a timer which is no longer in the timer
+// engine.
+static void timer_put(struct loop *loop, struct timer *t) {
+  int i = t->next;
+  t->ev.callback = NULL;
+  if (++t->gen > INT_MAX)
+    t->gen = 1;
+  t->next = loop->timer_free;
+  loop->timer_free = i;
+}
+
+// timer_fire is the callback of the event of a standalone timer. A timer
+// which doesn't repeat is freed after fn returns, unless fn restarted it
+// by timer_again or stopped it.
+static int timer_fire(struct loop *loop, struct ev *ev) {
+  struct timer *t = container_of(ev, struct timer, ev);
+  unsigned gen = t->gen;
+  int err;
+
+  err = t->fn(loop, ev->ud);
+  if (t->gen == gen && ev == loop->firing && !(ev->events & EV_PERSIST)) {
+    timer_del(loop, ev);
+    timer_put(loop, t);
+  }
+  return err;
+}
+
+long long timer_start(struct loop *loop, long long ms, int flags,
+                      int (*fn)(struct loop *, void *), void *arg) {
+  struct timer **pages, *t;
+  int i;
+
+  if (unlikely(ms <= 0 || !fn))
+    return -2;
+  if (loop->timer_free < 0) {
+    if (unlikely(loop->ntimers >= INT_MAX >> TIMER_BITS))
+      return -1;
+    pages = xalloc(loop->timers, sizeof(*pages) * (loop->ntimers + 1));
+    if (unlikely(!pages))
+      return -1;
+    loop->timers = pages;
+    if (unlikely(!(t = xalloc(NULL, sizeof(*t) * TIMER_PAGE))))
+      return -1;
+    pages[loop->ntimers] = t;
+    for (i = TIMER_PAGE - 1; i >= 0; i--) {
+      t[i].ev.callback = NULL;
+      t[i].gen = 1;
+      t[i].next = loop->timer_free;
+      loop->timer_free = (loop->ntimers << TIMER_BITS) + i;
+    }
+    loop->ntimers++;
+  }
+  i = loop->timer_free;
+  t = &loop->timers[i >> TIMER_BITS][i & TIMER_MASK];
+  // callbacks share the time cached by loop_dispatch, others can't
+  // tell how stale it is.
+  if (!loop->dispatching)
+    loop->now = clock_now();
+  t->ev.fd = -1;
+  t->ev.events = EV_TIMER | (flags & (EV_PERSIST | EV_CATCHUP));
+  t->ev.ms = ms;
+  t->ev.when = loop->now + ms * NS_PER_MS;
+  t->ev.callback = timer_fire;
+  t->ev.ud = arg;
+  t->fn = fn;
+  if (unlikely(timer_add(loop, &t->ev) < 0)) {
+    t->ev.callback = NULL;
+    return -1;
+  }
+  loop->timer_free = t->next;
+  t->next = i;
+  return (long long)t->gen << 32 | i;
+}
+
+int timer_stop(struct loop *loop, long long id) {
+  struct timer *t;
+
+  if (!(t = timer_get(loop, id)))
+    return -2;
+  timer_del(loop, &t->ev);
+  timer_put(loop, t);
+  return 0;
+}
+
+int timer_again(struct loop *loop, long long id) {
+  struct timer *t;
+
+  if (!(t = timer_get(loop, id)))
+    return -2;
+  if (!loop->dispatching)
+    loop->now = clock_now();
+  if (&t->ev != loop->firing)  // or else sifted in place by timer_add.
+    timer_del(loop, &t->ev);
+  t->ev.when = loop->now + t->ev.ms * NS_PER_MS;
+  if (unlikely(timer_add(loop, &t->ev) < 0)) {
+    timer_put(loop, t);
+    return -1;
+  }
+  return 0;
+}
+
+// timers_free frees the pages of standalone timers.
+static void timers_free(struct loop *loop) {
+  int i;
+  for (i = 0; i < loop->ntimers; i++)
+    xfree(loop->timers[i]);
+  if (loop->timers)
+    xfree(loop->timers);
+}
+
+// on_wake drains loop::wakefd and runs tasks posted by loop_post.
+static int on_wake(struct loop *loop, struct ev *ev) {
+  struct task *t, *next, *fifo = NULL;
+  char buf[64];
+  while (read(ev->fd, buf, sizeof(buf)) > 0)
+    ;
+  // clear the flag before taking the tasks, so that tasks posted from
+  // now on signal loop::wakefd again.
+  __atomic_store_n(&loop->woken, 0, __ATOMIC_SEQ_CST);
+  t = __atomic_exchange_n(&loop->tasks, NULL, __ATOMIC_ACQUIRE);
+  for (; t; t = next) {  // reverse them to run in the order posted.
+    next = t->next;
+    t->next = fifo;
+    fifo = t;
+  }
+  for (t = fifo; t; t = next) {
+    next = t->next;
+    t->fn(loop, t->arg);
+    xfree(t);
+  }
+  return 0;
+}
+
+// wake_init opens a file descriptor for other threads to wake up the
+// event loop with, an eventfd on Linux or a pipe otherwise. It is not
+// counted in loop::len_io so it doesn't keep loop_wait running.
+static int wake_init(struct loop *loop) {
+  struct fdent *e;
+  int fd;
+
+#ifdef __linux__
+  if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return fd;
+  loop->wakefd[0] = loop->wakefd[1] = fd;
+#else
+  if (pipe(loop->wakefd) < 0)
+    return -1;
+  fd = loop->wakefd[0];
+  fcntl(loop->wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(loop->wakefd[1], F_SETFL, O_NONBLOCK);
+  fcntl(loop->wakefd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(loop->wakefd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+  loop->wake.fd = fd;
+  loop->wake.events = EV_READ;
+  loop->wake.callback = on_wake;
+  e = fdt_alloc(loop, fd);
+  if (!e || api_ctl(loop, EV_CTL_ADD, fd, EV_READ) < 0) {
+    wake_free(loop);
+    return -1;
+  }
+  e->ev = &loop->wake;
+  e->mask = e->want = EV_READ;
+  if (loop->maxfd < fd)
+    loop->maxfd = fd;
+  return 0;
+}
+
+static void wake_free(struct loop *loop) {
+  struct task *t, *next;
+  for (t = loop->tasks; t; t = next) {  // dropped without running.
+    next = t->next;
+    xfree(t);
+  }
+  close(loop->wakefd[0]);
+  if (loop->wakefd[1] != loop->wakefd[0])
+    close(loop->wakefd[1]);
+}
+
+// wake_up wakes up the event loop from another thread.
+static void wake_up(struct loop *loop) {
+#ifdef __linux__
+  eventfd_write(loop->wakefd[1], 1);
+#else
+  char c = 0;
+  write(loop->wakefd[1], &c, 1);
+#endif
+}
+
+// loop_post pushes a task onto loop::tasks without locks, which is safe
+// since the event loop only ever takes the whole list. Only the first
+// post after the event loop has taken the tasks signals loop::wakefd,
+// so a burst of posts costs one write and one wakeup.
+int loop_post(struct loop *loop, void (*fn)(struct loop *, void *),
+              void *arg) {
+  struct task *t;
+  if (unlikely(!(t = xalloc(NULL, sizeof(*t)))))
+    return -1;
+  t->fn = fn;
+  t->arg = arg;
+  t->next = __atomic_load_n(&loop->tasks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&loop->tasks, &t->next, t, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  if (!__atomic_exchange_n(&loop->woken, 1, __ATOMIC_SEQ_CST))
+    wake_up(loop);
+  return 0;
+}
+
+int loop_yield(struct loop *loop, struct ev *ev) {
+  struct fdent *e;
+
+  if (unlikely(!(e = fdt_get(loop, ev->fd)) || e->ev != ev)) {
+    errno = ENOENT;
+    return -1;
+  }
+  e->flags |= FDE_YIELD;
+  return 0;
+}
+
+void loop_break(struct loop *loop) {
+  __atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+  wake_up(loop);
+}
+
 void loop_free(struct loop *loop) {
-  api_free(loop);
+  wake_free(loop);
+  loop->api->free(loop);
+  if (loop->wheel)
+    wheel_free(loop->wheel);
+  fdt_free(loop);
+  timers_free(loop);
   xalloc(loop->fired, 0);
-  xalloc(loop->events, 0);
   xalloc(loop->heap, 0);
+#ifdef X_TRACE
+  xalloc(loop->trace, 0);
+#endif
   xalloc(loop, 0);
 }
@@ -1,14 +1,18 @@
 #ifdef __linux__
 
+#include <limits.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 
-struct state {
+struct epoll_state {
   int epfd;
+  int tfd;  // timerfd for LOOP_HIRES on kernels without epoll_pwait2.
   struct epoll_event *events;
 };
 
-static int api_init(struct loop *loop) {
-  struct state *state;
+static int epoll_api_init(struct loop *loop) {
+  struct epoll_state *state;
 
   state = xalloc(NULL, sizeof(*state));
   if (unlikely(!state))
@@ -21,36 +25,40 @@ static int api_init(struct loop *loop) {
   state->epfd = epoll_create(1024);
   if (state->epfd < 0)
     goto err;
+  state->tfd = -1;
 
   loop->state = state;
   return 0;
 
 err:
-  if (state->events)
+  if (state && state->events)
     xalloc(state->events, 0);
   if (state)
     xalloc(state, 0);
   return -1;
 }
 
-static void api_free(struct loop *loop) {
-  struct state *state = loop->state;
+static void epoll_api_free(struct loop *loop) {
+  struct epoll_state *state = loop->state;
   close(state->epfd);
+  if (state->tfd >= 0)
+    close(state->tfd);
   xalloc(state->events, 0);
   xalloc(state, 0);
 }
 
-static int api_realloc(struct loop *loop, int cap) {
-  struct state *state = loop->state;
+static int epoll_api_realloc(struct loop *loop, int cap) {
+  struct epoll_state *state = loop->state;
   state->events = xalloc(state->events, sizeof(struct epoll_event) * cap);
   if (unlikely(!state->events))
     return -1;
   return 0;
 }
 
-static int api_ctl(struct loop *loop, int op, int fd, int events) {
-  struct state *state = loop->state;
+static int epoll_api_ctl(struct loop *loop, int op, int fd, int events) {
+  struct epoll_state *state = loop->state;
   struct epoll_event ev;
+  struct fdent *e;
 
   switch (op) {
   case EV_CTL_ADD:
@@ -68,31 +76,102 @@ static int api_ctl(struct loop *loop, int op, int fd, int events) {
   if (op < 0)
     return -2;
 
-  ev.data.fd = fd;
+  // the entry of the fd table is handed back by epoll_wait, so that a
+  // fired event takes no lookup, see struct ev_fired.
+  e = fdt_get(loop, fd);
+  ev.data.ptr = e;
+  // an exclusive registration can't be modified, so it is deleted and
+  // added again with the new events.
+  if (op == EPOLL_CTL_MOD && e && ((events | e->mask) & EV_EXCLUSIVE)) {
+    epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ev);
+    op = EPOLL_CTL_ADD;
+  }
   ev.events = 0;
   if (events & EV_READ)
     ev.events |= EPOLLIN;
   if (events & EV_WRITE)
     ev.events |= EPOLLOUT;
-  if (epoll_ctl(state->epfd, op, fd, &ev) < 0)
+  if (events & EV_ET)
+    ev.events |= EPOLLET;
+  if (events & EV_ONCE)
+    ev.events |= EPOLLONESHOT;
+  if ((events & EV_EXCLUSIVE) && op == EPOLL_CTL_ADD)  // EINVAL otherwise.
+    ev.events |= EPOLLEXCLUSIVE;
+  if (epoll_ctl(state->epfd, op, fd, &ev) == 0)
+    return 0;
+  // the registration is gone if the fd was closed and opened again,
+  // see changes_apply.
+  if (op != EPOLL_CTL_MOD || errno != ENOENT ||
+      epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
     return -2;
   return 0;
 }
 
-static int api_poll(struct loop *loop, struct timeval *tv) {
-  struct state *state = loop->state;
-  struct epoll_event *ev;
-  int nevents, timeout, i, events;
+// epoll_wait_ns waits for IO events for 'timeout' nanoseconds with
+// epoll_pwait2 (Linux 5.11), or with a timerfd on older kernels.
+static int epoll_wait_ns(struct loop *loop, long long timeout) {
+  struct epoll_state *state = loop->state;
+  struct itimerspec its;
+  struct epoll_event ev;
+  int n;
+
+#ifdef __NR_epoll_pwait2
+  if (state->tfd < 0) {
+    its.it_value.tv_sec = timeout / 1000000000LL;
+    its.it_value.tv_nsec = timeout % 1000000000LL;
+    n = syscall(__NR_epoll_pwait2, state->epfd, state->events, loop->cap,
+                &its.it_value, NULL, 0);
+    if (n >= 0 || errno != ENOSYS)
+      return n;
+  }
+#endif
+
+  if (state->tfd < 0) {
+    state->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (state->tfd < 0)
+      return -1;
+    ev.data.ptr = NULL;  // not an entry of the fd table.
+    ev.events = EPOLLIN;
+    if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->tfd, &ev) < 0)
+      return -1;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = timeout / 1000000000LL;
+  its.it_value.tv_nsec = timeout % 1000000000LL;
+  if (timerfd_settime(state->tfd, 0, &its, NULL) < 0)
+    return -1;
+  return epoll_wait(state->epfd, state->events, loop->cap, -1);
+}
 
-  timeout = tv ? tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000 : -1;
-  nevents = epoll_wait(state->epfd, state->events, loop->cap, timeout);
+static int epoll_api_poll(struct loop *loop, long long timeout) {
+  struct epoll_state *state = loop->state;
+  struct epoll_event *ev;
+  unsigned long long ticks;
+  int nevents, ms, i, j, events;
+
+  if (timeout > 0 && (loop->flags & LOOP_HIRES))
+    nevents = epoll_wait_ns(loop, timeout);
+  else {
+    // round up to milliseconds so that we never wake up too early.
+    if (timeout < 0)
+      ms = -1;
+    else if (timeout >= INT_MAX * NS_PER_MS)
+      ms = INT_MAX;
+    else
+      ms = (timeout + NS_PER_MS - 1) / NS_PER_MS;
+    nevents = epoll_wait(state->epfd, state->events, loop->cap, ms);
+  }
   if (unlikely(nevents < 0 && errno != EINTR)) {
     perror("api_poll: epoll");
     exit(1);
   }
-  for (i = 0; i < nevents; i++) {
+  for (i = j = 0; i < nevents; i++) {
     events = 0;
     ev = state->events + i;
+    if (!ev->data.ptr) {  // timerfd
+      read(state->tfd, &ticks, sizeof(ticks));
+      continue;
+    }
     if (ev->events & EPOLLIN)
       events |= EV_READ;
     if (ev->events & EPOLLOUT)
@@ -101,10 +180,19 @@ static int api_poll(struct loop *loop, struct timeval *tv) {
       events |= EV_WRITE | EV_READ;
     if (ev->events & EPOLLHUP)
       events |= EV_WRITE | EV_READ;  // fd is closed.
-    loop->fired[i].fd = ev->data.fd;
-    loop->fired[i].events = events;
+    fired_set(&loop->fired[j++], ev->data.ptr, events);
   }
-  return nevents;
+  return j;
 }
 
+static const struct backend epoll_backend = {
+    .name = "epoll",
+    .id = LOOP_EPOLL,
+    .init = epoll_api_init,
+    .free = epoll_api_free,
+    .realloc = epoll_api_realloc,
+    .ctl = epoll_api_ctl,
+    .poll = epoll_api_poll,
+};
+
 #endif
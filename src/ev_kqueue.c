@@ -1,17 +1,15 @@
-#ifdef __APPLE__
+#ifdef HAVE_KQUEUE
 
 #include <sys/event.h>
 #include <sys/time.h>
 
-struct state {
+struct kqueue_state {
   int kq;
   struct kevent *events;
-  unsigned char *revents;  // for merging fired events by `kevent()` :(
-                           // TODO: use bitset to reduce memory usage.
 };
 
-static int api_init(struct loop *loop) {
-  struct state *state;
+static int kqueue_api_init(struct loop *loop) {
+  struct kqueue_state *state;
 
   state = xalloc(NULL, sizeof(*state));
   if (unlikely(!state))
@@ -21,11 +19,6 @@ static int api_init(struct loop *loop) {
   if (unlikely(!state->events))
     goto err;
 
-  state->revents = xalloc(NULL, sizeof(unsigned char) * loop->cap);
-  if (unlikely(!state->revents))
-    goto err;
-  memset(state->revents, 0, sizeof(unsigned char) * loop->cap);
-
   state->kq = kqueue();
   if (unlikely(state->kq < 0))
     goto err;
@@ -34,47 +27,45 @@ static int api_init(struct loop *loop) {
   return 0;
 
 err:
-  if (state->events)
+  if (state && state->events)
     xalloc(state->events, 0);
-  if (state->revents)
-    xalloc(state->revents, 0);
   if (state)
     xalloc(state, 0);
   return -1;
 }
 
-static void api_free(struct loop *loop) {
-  struct state *state = loop->state;
+static void kqueue_api_free(struct loop *loop) {
+  struct kqueue_state *state = loop->state;
   close(state->kq);
   xalloc(state->events, 0);
   xalloc(state, 0);
 }
 
-static int api_realloc(struct loop *loop, int cap) {
-  struct state *state = loop->state;
-  state->events = xalloc(state->events, sizeof(struct kevent) * cap);
-  if (unlikely(!state->events))
-    goto err;
-  state->revents = xalloc(state->revents, sizeof(unsigned char) * cap);
-  if (unlikely(!state->revents))
-    goto err;
-  memset(state->revents, 0, sizeof(unsigned char) * cap);
+static int kqueue_api_realloc(struct loop *loop, int cap) {
+  struct kqueue_state *state = loop->state;
+  struct kevent *events;
+  events = xalloc(state->events, sizeof(struct kevent) * cap);
+  if (unlikely(!events))
+    return -1;
+  state->events = events;
   return 0;
-err:
-  if (state->events)
-    xalloc(state->events, 0);
-  if (state->revents)
-    xalloc(state->revents, 0);
-  return -1;
 }
 
-static int api_ctl(struct loop *loop, int op, int fd, int events) {
-  struct state *state = loop->state;
+static int kqueue_api_ctl(struct loop *loop, int op, int fd, int events) {
+  struct kqueue_state *state = loop->state;
   struct kevent ev;
+  int old;
 
   switch (op) {
   case EV_CTL_ADD:
+    op = EV_ADD;
+    break;
   case EV_CTL_MOD:
+    // delete the filters no longer wanted, fdent::mask still holds the
+    // events registered.
+    old = fdt_get(loop, fd)->mask & ~events;
+    if (old & EV_IO)
+      kqueue_api_ctl(loop, EV_CTL_DEL, fd, old);
     op = EV_ADD;
     break;
   case EV_CTL_DEL:
@@ -84,6 +75,11 @@ static int api_ctl(struct loop *loop, int op, int fd, int events) {
     return -2;
   }
 
+  if (op == EV_ADD && (events & EV_ET))
+    op |= EV_CLEAR;
+  if (op == EV_ADD && (events & EV_ONCE))
+    op |= EV_ONESHOT;
+
   // This is way less cool than epoll :(
 
   if (events & EV_READ) {
@@ -99,15 +95,16 @@ static int api_ctl(struct loop *loop, int op, int fd, int events) {
   return 0;
 }
 
-static int api_poll(struct loop *loop, struct timeval *tv) {
-  struct state *state = loop->state;
+static int kqueue_api_poll(struct loop *loop, long long timeout) {
+  struct kqueue_state *state = loop->state;
   struct kevent *ev;
+  struct fdent *e;
   struct timespec ts, *pts = NULL;
   int n, i, nevents = 0;
 
-  if (tv) {
-    ts.tv_sec = tv->tv_sec;
-    ts.tv_nsec = tv->tv_usec * 1000;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000000000LL;
+    ts.tv_nsec = timeout % 1000000000LL;
     pts = &ts;
   }
 
@@ -117,30 +114,38 @@ static int api_poll(struct loop *loop, struct timeval *tv) {
     exit(1);
   }
 
-  unsigned char *pe;
+  // merge fired events in fdent::revents of the fd table.
   for (i = 0; i < n; i++) {
     ev = state->events + i;
-    pe = state->revents + ev->ident;
-    // merge fired events
+    if (!(e = fdt_get(loop, ev->ident)))
+      continue;
     if (ev->filter == EVFILT_READ)
-      *pe |= EV_READ;
+      e->revents |= EV_READ;
     else if (ev->filter == EVFILT_WRITE)
-      *pe |= EV_WRITE;
+      e->revents |= EV_WRITE;
   }
 
   for (i = 0; i < n; i++) {
     ev = state->events + i;
-    pe = state->revents + ev->ident;
-
-    if (*pe) {
-      loop->fired[i].fd = ev->ident;
-      loop->fired[i].events = *pe;
-      *pe = 0;  // reset
-      nevents++;
+    if (!(e = fdt_get(loop, ev->ident)))
+      continue;
+    if (e->revents) {
+      fired_set(&loop->fired[nevents++], e, e->revents);
+      e->revents = 0;  // reset
     }
   }
 
   return nevents;
 }
 
+static const struct backend kqueue_backend = {
+    .name = "kqueue",
+    .id = LOOP_KQUEUE,
+    .init = kqueue_api_init,
+    .free = kqueue_api_free,
+    .realloc = kqueue_api_realloc,
+    .ctl = kqueue_api_ctl,
+    .poll = kqueue_api_poll,
+};
+
 #endif
@@ -0,0 +1,155 @@
+// A poll(2) backend for systems, or sandboxes, without epoll and kqueue.
+// Watched fds are kept in a dense array of struct pollfd, so a poll costs
+// the number of fds watched rather than the highest fd like select does,
+// and there's no FD_SETSIZE limit. The slot of an fd in the array is kept
+// in fdent::slot, and a removed slot is filled by the last one. IO events
+// are level-triggered, EV_ET falls back to it, and EV_ONCE is emulated by
+// clearing the slot once it fires.
+
+#include <limits.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+struct poll_state {
+  struct pollfd *fds;
+  int len;  // the number of fds watched.
+  int cap;  // the number of slots allocated for poll_state::fds.
+};
+
+static int poll_api_init(struct loop *loop) {
+  struct poll_state *state;
+
+  state = xalloc(NULL, sizeof(*state));
+  if (unlikely(!state))
+    return -1;
+  state->cap = loop->cap > 0 ? loop->cap : 1;
+  state->fds = xalloc(NULL, sizeof(struct pollfd) * state->cap);
+  if (unlikely(!state->fds)) {
+    xalloc(state, 0);
+    return -1;
+  }
+  state->len = 0;
+  loop->state = state;
+  return 0;
+}
+
+static void poll_api_free(struct loop *loop) {
+  struct poll_state *state = loop->state;
+  xalloc(state->fds, 0);
+  xalloc(state, 0);
+}
+
+// poll_state::fds grows with the fds watched in poll_api_ctl rather than with
+// loop::fired.
+static int poll_api_realloc(struct loop *loop, int cap) { return 0; }
+
+static inline short poll_events(int events) {
+  short ev = 0;
+  if (events & EV_READ)
+    ev |= POLLIN;
+  if (events & EV_WRITE)
+    ev |= POLLOUT;
+  return ev;
+}
+
+static int poll_api_ctl(struct loop *loop, int op, int fd, int events) {
+  struct poll_state *state = loop->state;
+  struct fdent *e = fdt_get(loop, fd);
+  struct pollfd *fds;
+  int cap, last;
+
+  if (unlikely(!e))
+    return -2;
+  switch (op) {
+  case EV_CTL_ADD:
+    if (state->len >= state->cap) {
+      cap = state->cap + state->cap / 2 + 1;  // 1.5x the current capacity
+      fds = xalloc(state->fds, sizeof(*fds) * cap);
+      if (unlikely(!fds))
+        return -1;
+      state->fds = fds;
+      state->cap = cap;
+    }
+    e->slot = state->len++;
+    state->fds[e->slot].fd = fd;
+    state->fds[e->slot].events = poll_events(events);
+    state->fds[e->slot].revents = 0;
+    return 0;
+  case EV_CTL_MOD:
+    state->fds[e->slot].events = poll_events(events);
+    return 0;
+  case EV_CTL_DEL:
+    last = --state->len;
+    if (e->slot != last) {  // move the last one into the hole.
+      state->fds[e->slot] = state->fds[last];
+      fdt_get(loop, state->fds[e->slot].fd)->slot = e->slot;
+    }
+    e->slot = -1;
+    return 0;
+  default:
+    return -2;
+  }
+}
+
+static int poll_api_poll(struct loop *loop, long long timeout) {
+  struct poll_state *state = loop->state;
+  struct pollfd *p;
+  struct fdent *e;
+  int n, i, ms, events, nevents = 0;
+
+#ifdef __NR_ppoll
+  struct timespec ts;
+  if (timeout > 0 && (loop->flags & LOOP_HIRES)) {
+    ts.tv_sec = timeout / 1000000000LL;
+    ts.tv_nsec = timeout % 1000000000LL;
+    n = syscall(__NR_ppoll, state->fds, state->len, &ts, NULL, 0);
+  } else
+#endif
+  {
+    // round up to milliseconds so that we never wake up too early.
+    if (timeout < 0)
+      ms = -1;
+    else if (timeout >= INT_MAX * NS_PER_MS)
+      ms = INT_MAX;
+    else
+      ms = (timeout + NS_PER_MS - 1) / NS_PER_MS;
+    n = poll(state->fds, state->len, ms);
+  }
+  if (unlikely(n < 0 && errno != EINTR)) {
+    perror("api_poll: poll");
+    exit(1);
+  }
+
+  // stop scanning once all the fds ready are found, those beyond
+  // loop::cap are level-triggered and fired by the next call.
+  for (i = 0; i < state->len && n > 0 && nevents < loop->cap; i++) {
+    p = &state->fds[i];
+    if (!p->revents)
+      continue;
+    n--;
+    events = 0;
+    if (p->revents & POLLIN)
+      events |= EV_READ;
+    if (p->revents & POLLOUT)
+      events |= EV_WRITE;
+    if (p->revents & (POLLERR | POLLHUP | POLLNVAL))
+      events |= EV_WRITE | EV_READ;  // fd is closed.
+    e = fdt_get(loop, p->fd);
+    fired_set(&loop->fired[nevents++], e, events);
+    if (e->mask & EV_ONCE)  // disabled until loop_mod.
+      p->events = 0;
+  }
+  return nevents;
+}
+
+static const struct backend poll_backend = {
+    .name = "poll",
+    .id = LOOP_POLL,
+    .init = poll_api_init,
+    .free = poll_api_free,
+    .realloc = poll_api_realloc,
+    .ctl = poll_api_ctl,
+    .poll = poll_api_poll,
+};
@@ -1,12 +1,12 @@
 #include <sys/select.h>
 
-struct state {
+struct select_state {
   fd_set rfds;
   fd_set wfds;
 };
 
-static int api_init(struct loop *loop) {
-  struct state *state;
+static int select_api_init(struct loop *loop) {
+  struct select_state *state;
   state = xalloc(NULL, sizeof(*state));
   if (unlikely(!state))
     return -1;
@@ -16,17 +16,17 @@ static int api_init(struct loop *loop) {
   return 0;
 }
 
-static void api_free(struct loop *loop) {
+static void select_api_free(struct loop *loop) {
   if (loop->state)
     xalloc(loop->state, 0);
 }
 
-static int api_realloc(struct loop *loop, int cap) {
-  return cap <= FD_SETSIZE ? 0 : -1;
-}
+static int select_api_realloc(struct loop *loop, int cap) { return 0; }
 
-static int api_ctl(struct loop *loop, int op, int fd, int events) {
-  struct state *state = loop->state;
+static int select_api_ctl(struct loop *loop, int op, int fd, int events) {
+  struct select_state *state = loop->state;
+  if (fd >= FD_SETSIZE)
+    return -2;
   switch (op) {
   case EV_CTL_ADD:
     if (events & EV_READ)
@@ -34,6 +34,14 @@ static int api_ctl(struct loop *loop, int op, int fd, int events) {
     if (events & EV_WRITE)
       FD_SET(fd, &state->wfds);
     break;
+  case EV_CTL_MOD:
+    FD_CLR(fd, &state->rfds);
+    FD_CLR(fd, &state->wfds);
+    if (events & EV_READ)
+      FD_SET(fd, &state->rfds);
+    if (events & EV_WRITE)
+      FD_SET(fd, &state->wfds);
+    break;
   case EV_CTL_DEL:
     if (events & EV_READ)
       FD_CLR(fd, &state->rfds);
@@ -46,38 +54,59 @@ static int api_ctl(struct loop *loop, int op, int fd, int events) {
   return 0;
 }
 
-static int api_poll(struct loop *loop, struct timeval *tv) {
-  struct state *state = loop->state;
+static int select_api_poll(struct loop *loop, long long timeout) {
+  struct select_state *state = loop->state;
   struct ev *ev;
-  int nevents, i, events;
+  struct fdent *e;
+  struct timeval tv, *ptv = NULL;
+  int nevents, i, events, maxfd;
   fd_set rfds, wfds;
 
   rfds = state->rfds;
   wfds = state->wfds;
 
-  nevents = select(loop->maxfd, &rfds, &wfds, NULL, tv);
+  if (timeout >= 0) {
+    timeout = (timeout + 999) / 1000;  // round up to microseconds.
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+    ptv = &tv;
+  }
+
+  // fds beyond FD_SETSIZE are refused by select_api_ctl, but still
+  // counted in loop::maxfd.
+  maxfd = loop->maxfd < FD_SETSIZE ? loop->maxfd : FD_SETSIZE - 1;
+  nevents = select(maxfd + 1, &rfds, &wfds, NULL, ptv);
   if (unlikely(nevents < 0 && errno != EINTR)) {
     perror("api_poll:select");
     exit(1);
   }
+  if (nevents <= 0)  // fd sets are undefined on EINTR.
+    return 0;
 
   // we have to iterate over all the events added cuz it's `select` :(
   nevents = 0;
-  for (i = 0; i < loop->maxfd; i++) {
+  for (i = 0; i <= maxfd && nevents < loop->cap; i++) {
     events = 0;
-    ev = loop->events[i];
-    if (ev->events == EV_NONE)
+    if (!(e = fdt_get(loop, i)) || !(ev = e->ev))
       continue;
-    if (FD_ISSET(ev->fd, &state->rfds))
+    if (FD_ISSET(ev->fd, &rfds))
       events |= EV_READ;
-    if (FD_ISSET(ev->fd, &state->wfds))
+    if (FD_ISSET(ev->fd, &wfds))
       events |= EV_WRITE;
     if (events) {
-      loop->fired[nevents].fd = ev->fd;
-      loop->fired[nevents].events = events;
-      nevents++;
+      fired_set(&loop->fired[nevents++], e, events);
     }
   }
 
   return nevents;
-}
\ No newline at end of file
+}
+
+static const struct backend select_backend = {
+    .name = "select",
+    .id = LOOP_SELECT,
+    .init = select_api_init,
+    .free = select_api_free,
+    .realloc = select_api_realloc,
+    .ctl = select_api_ctl,
+    .poll = select_api_poll,
+};
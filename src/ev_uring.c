@@ -0,0 +1,360 @@
+#ifdef HAVE_URING
+
+// An io_uring backend (Linux 5.11+) talking to the kernel by raw syscalls.
+// IO events are oneshot poll requests which are re-armed as soon as they
+// complete, which makes them level-triggered like epoll. Requests to read,
+// write, accept and connect are submitted to the same ring, so that both
+// kinds are batched by one io_uring_enter per call to api_poll.
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 256
+
+// user_data of a poll request has its lowest bit set, and carries the fd
+// and the generation of its registration so that completions of a poll
+// request that has been removed are ignored. Requests of loop_submit have user_data
+// pointing to the struct ev_req, and removals have it zeroed.
+#define POLL_DATA(fd, gen)                                                     \
+  (((unsigned long long)(gen) << 33) | ((unsigned long long)(fd) << 1) | 1)
+
+static void uring_api_free(struct loop *);
+
+struct uring_state {
+  int ringfd;
+  unsigned tail;         // local tail of the submission queue.
+  unsigned unsubmitted;  // entries queued but not submitted yet.
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned gen;  // the last generation given to a registration.
+};
+
+static int uring_enter(struct uring_state *state, unsigned min_complete,
+                       long long timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  void *argp = NULL;
+  size_t argsz = 0;
+  int n;
+
+  __atomic_store_n(state->sq_tail, state->tail, __ATOMIC_RELEASE);
+  if (min_complete) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1000000000LL;
+      ts.tv_nsec = timeout % 1000000000LL;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (unsigned long long)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+  }
+  n = syscall(__NR_io_uring_enter, state->ringfd, state->unsubmitted,
+              min_complete, flags, argp, argsz);
+  if (n < 0)
+    return (errno == ETIME || errno == EINTR) ? 0 : n;
+  state->unsubmitted -= n;
+  return n;
+}
+
+// uring_sqe returns a zeroed submission queue entry, submitting what has
+// been queued if the queue is full, or NULL if it is still full.
+static struct io_uring_sqe *uring_sqe(struct uring_state *state) {
+  struct io_uring_sqe *sqe;
+  unsigned i;
+
+  if (state->tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) >=
+      state->sq_entries) {
+    if (uring_enter(state, 0, 0) < 0)
+      return NULL;
+    if (state->tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) >=
+        state->sq_entries)
+      return NULL;
+  }
+  i = state->tail & *state->sq_mask;
+  sqe = &state->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  state->sq_array[i] = i;
+  state->tail++;
+  state->unsubmitted++;
+  return sqe;
+}
+
+// uring_gen returns a new generation for a registration of an fd, which
+// is kept in fdent::gen along with the events polled in fdent::events.
+// It is unique in the loop rather than in the fd, since the entry of the
+// fd is freed with its page.
+static unsigned uring_gen(struct uring_state *state) {
+  state->gen = (state->gen + 1) & 0x7fffffff;  // 31 bits in user_data.
+  if (!state->gen)
+    state->gen = 1;
+  return state->gen;
+}
+
+static int uring_poll_add(struct uring_state *state, int fd, struct fdent *e) {
+  struct io_uring_sqe *sqe;
+  int events = e->events;
+
+  if (!(sqe = uring_sqe(state)))
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  if ((events & EV_ET) && !(events & EV_ONCE))  // fires on every wakeup.
+    sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = 0;
+  if (events & EV_READ)
+    sqe->poll32_events |= POLLIN;
+  if (events & EV_WRITE)
+    sqe->poll32_events |= POLLOUT;
+  sqe->user_data = POLL_DATA(fd, e->gen);
+  return 0;
+}
+
+static int uring_poll_remove(struct uring_state *state, int fd,
+                             struct fdent *e) {
+  struct io_uring_sqe *sqe;
+  if (!(sqe = uring_sqe(state)))
+    return -1;
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = POLL_DATA(fd, e->gen);
+  sqe->user_data = 0;
+  e->gen = 0;
+  return 0;
+}
+
+static int uring_api_init(struct loop *loop) {
+  struct io_uring_params p;
+  struct uring_state *state;
+
+  state = xalloc(NULL, sizeof(*state));
+  if (unlikely(!state))
+    return -1;
+  memset(state, 0, sizeof(*state));
+  state->ringfd = -1;
+  state->sq_ptr = state->cq_ptr = MAP_FAILED;
+  state->sqes = MAP_FAILED;
+
+  memset(&p, 0, sizeof(p));
+  state->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (state->ringfd < 0)
+    goto err;
+  if (!(p.features & IORING_FEAT_EXT_ARG))
+    goto err;
+
+  state->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  state->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (state->cq_size > state->sq_size)
+      state->sq_size = state->cq_size;
+    state->cq_size = state->sq_size;
+  }
+  state->sq_ptr = mmap(NULL, state->sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, state->ringfd,
+                       IORING_OFF_SQ_RING);
+  if (state->sq_ptr == MAP_FAILED)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    state->cq_ptr = state->sq_ptr;
+  else {
+    state->cq_ptr = mmap(NULL, state->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, state->ringfd,
+                         IORING_OFF_CQ_RING);
+    if (state->cq_ptr == MAP_FAILED)
+      goto err;
+  }
+  state->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     state->ringfd, IORING_OFF_SQES);
+  if (state->sqes == MAP_FAILED)
+    goto err;
+
+  state->sq_head = state->sq_ptr + p.sq_off.head;
+  state->sq_tail = state->sq_ptr + p.sq_off.tail;
+  state->sq_mask = state->sq_ptr + p.sq_off.ring_mask;
+  state->sq_array = state->sq_ptr + p.sq_off.array;
+  state->sq_entries = p.sq_entries;
+  state->tail = *state->sq_tail;
+  state->cq_head = state->cq_ptr + p.cq_off.head;
+  state->cq_tail = state->cq_ptr + p.cq_off.tail;
+  state->cq_mask = state->cq_ptr + p.cq_off.ring_mask;
+  state->cqes = state->cq_ptr + p.cq_off.cqes;
+
+  loop->state = state;
+  return 0;
+
+err:
+  loop->state = state;
+  uring_api_free(loop);
+  return -1;
+}
+
+static void uring_api_free(struct loop *loop) {
+  struct uring_state *state = loop->state;
+  if (state->sqes != MAP_FAILED)
+    munmap(state->sqes, state->sq_entries * sizeof(struct io_uring_sqe));
+  if (state->cq_ptr != MAP_FAILED && state->cq_ptr != state->sq_ptr)
+    munmap(state->cq_ptr, state->cq_size);
+  if (state->sq_ptr != MAP_FAILED)
+    munmap(state->sq_ptr, state->sq_size);
+  if (state->ringfd >= 0)
+    close(state->ringfd);
+  xalloc(state, 0);
+}
+
+static int uring_api_realloc(struct loop *loop, int cap) { return 0; }
+
+static int uring_api_ctl(struct loop *loop, int op, int fd, int events) {
+  struct uring_state *state = loop->state;
+  struct fdent *e = fdt_get(loop, fd);
+
+  if (unlikely(!e))
+    return -2;
+  switch (op) {
+  case EV_CTL_ADD:
+    break;
+  case EV_CTL_MOD:
+    if (uring_poll_remove(state, fd, e) < 0)
+      return -2;
+    break;
+  case EV_CTL_DEL:
+    if (uring_poll_remove(state, fd, e) < 0)
+      return -2;
+    e->events = 0;
+    return 0;
+  default:
+    return -2;
+  }
+  e->events = events & (EV_IO | EV_ET | EV_ONCE);
+  e->gen = uring_gen(state);
+  if (uring_poll_add(state, fd, e) < 0)
+    return -2;
+  return 0;
+}
+
+static int uring_api_submit(struct loop *loop, struct ev_req *req) {
+  struct uring_state *state = loop->state;
+  struct io_uring_sqe *sqe;
+
+  if (!(sqe = uring_sqe(state)))
+    return -1;
+  sqe->fd = req->fd;
+  sqe->addr = (unsigned long long)req->buf;
+  switch (req->op) {
+  case EV_OP_READ:
+    sqe->opcode = IORING_OP_READ;
+    sqe->len = req->len;
+    sqe->off = -1;  // the current file position.
+    break;
+  case EV_OP_WRITE:
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->len = req->len;
+    sqe->off = -1;
+    break;
+  case EV_OP_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr2 = (unsigned long long)&req->len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    break;
+  case EV_OP_CONNECT:
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->off = req->len;
+    break;
+  default:  // take the entry back.
+    state->tail--;
+    state->unsubmitted--;
+    return -2;
+  }
+  sqe->user_data = (unsigned long long)req;
+  return 0;
+}
+
+static int uring_api_poll(struct loop *loop, long long timeout) {
+  struct uring_state *state = loop->state;
+  struct io_uring_cqe *cqe;
+  struct ev_req *req;
+  struct fdent *e;
+  unsigned long long data;
+  unsigned head, tail;
+  int nevents = 0, fd, events, err;
+
+  head = *state->cq_head;
+  tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+  // submit what has been queued, and wait for completions only if
+  // there's none yet.
+  err = uring_enter(state, head == tail && timeout != 0, timeout);
+  if (unlikely(err < 0)) {
+    perror("api_poll: io_uring_enter");
+    exit(1);
+  }
+
+  tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail && nevents < loop->cap; head++) {
+    cqe = &state->cqes[head & *state->cq_mask];
+    data = cqe->user_data;
+    if (!data)
+      continue;
+    if (!(data & 1)) {
+      req = (struct ev_req *)data;
+      req->res = cqe->res;
+      req->next = NULL;
+      *loop->done_tail = req;
+      loop->done_tail = &req->next;
+      continue;
+    }
+    fd = (data >> 1) & 0xffffffff;
+    e = fdt_get(loop, fd);
+    if (!e || !e->events || POLL_DATA(fd, e->gen) != data)
+      continue;  // removed.
+    if (cqe->res < 0) {
+      // failed, e.g. polling a closed fd, which is reported like an
+      // error polled and not re-armed.
+      fired_set(&loop->fired[nevents++], e, EV_WRITE | EV_READ);
+      continue;
+    }
+    events = 0;
+    if (cqe->res & POLLIN)
+      events |= EV_READ;
+    if (cqe->res & POLLOUT)
+      events |= EV_WRITE;
+    if (cqe->res & (POLLERR | POLLHUP))
+      events |= EV_WRITE | EV_READ;
+    fired_set(&loop->fired[nevents++], e, events);
+    // re-arm it unless it is oneshot, or multishot and still armed,
+    // which is submitted by the next call.
+    if (!(e->events & EV_ONCE) && !(cqe->flags & IORING_CQE_F_MORE))
+      uring_poll_add(state, fd, e);
+  }
+  __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+  return nevents;
+}
+
+static const struct backend uring_backend = {
+    .name = "uring",
+    .id = LOOP_URING,
+    .init = uring_api_init,
+    .free = uring_api_free,
+    .realloc = uring_api_realloc,
+    .ctl = uring_api_ctl,
+    .poll = uring_api_poll,
+    .submit = uring_api_submit,
+};
+
+#endif
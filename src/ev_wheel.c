@@ -0,0 +1,259 @@
+// A hierarchical timing wheel with millisecond ticks, see "Hashed and
+// Hierarchical Timing Wheels" by Varghese and Lauck. Timers are kept in
+// WHEEL_LEVELS wheels of WHEEL_SIZE slots each, a timer due within 2^8ms
+// sits in level 0, within 2^16ms in level 1 and so on. Slots of an upper
+// level are cascaded down to lower levels when the lower ones wrap around.
+// Inserting, cancelling and expiring a timer are all O(1).
+
+#define WHEEL_BITS   8
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_WORDS  (WHEEL_SIZE / 64)
+#define WHEEL_DUE    (WHEEL_LEVELS * WHEEL_SIZE)  // slot of expired timers.
+#define WHEEL_SPAN   (1LL << (WHEEL_BITS * WHEEL_LEVELS))
+
+// struct wnode links a timer into a slot of the wheel. Nodes are kept in
+// an array and linked by their indexes in circular lists, so the index
+// of a node can be saved in ev::id.
+struct wnode {
+  long long when;  // deadline in milliseconds.
+  struct ev *ev;
+  int slot;        // slot the node is linked in, -1 if the node is free.
+  int prev;
+  int next;
+};
+
+struct wheel {
+  long long now;        // the next tick to be processed.
+  int len;              // the number of timers in the wheel.
+  int cap;              // the number of nodes allocated.
+  int free;             // the first free node.
+  struct wnode *nodes;  // nodes indexed by ev::id.
+  int head[WHEEL_DUE + 1];
+  unsigned long long bits[WHEEL_LEVELS][WHEEL_WORDS];  // non-empty slots.
+};
+
+static struct wheel *wheel_alloc(long long now, int cap) {
+  struct wheel *w;
+  int i;
+
+  w = xalloc(NULL, sizeof(*w));
+  if (unlikely(!w))
+    return NULL;
+  memset(w, 0, sizeof(*w));
+
+  w->nodes = xalloc(NULL, sizeof(struct wnode) * cap);
+  if (unlikely(!w->nodes)) {
+    xalloc(w, 0);
+    return NULL;
+  }
+  for (i = 0; i < cap; i++) {
+    w->nodes[i].slot = -1;
+    w->nodes[i].next = i + 1 < cap ? i + 1 : -1;
+  }
+  for (i = 0; i <= WHEEL_DUE; i++)
+    w->head[i] = -1;
+  w->now = now;
+  w->cap = cap;
+  w->free = 0;
+  return w;
+}
+
+static void wheel_free(struct wheel *w) {
+  xalloc(w->nodes, 0);
+  xalloc(w, 0);
+}
+
+// wheel_link appends node i to the tail of the given slot.
+static void wheel_link(struct wheel *w, int i, int slot) {
+  struct wnode *n = &w->nodes[i];
+  int h = w->head[slot];
+  n->slot = slot;
+  if (h < 0) {
+    n->prev = n->next = i;
+    w->head[slot] = i;
+    if (slot < WHEEL_DUE)
+      w->bits[slot / WHEEL_SIZE][(slot & WHEEL_MASK) / 64] |=
+          1ULL << (slot & 63);
+    return;
+  }
+  n->next = h;
+  n->prev = w->nodes[h].prev;
+  w->nodes[n->prev].next = i;
+  w->nodes[h].prev = i;
+}
+
+// wheel_unlink removes node i from the slot it is linked in.
+static void wheel_unlink(struct wheel *w, int i) {
+  struct wnode *n = &w->nodes[i];
+  int slot = n->slot;
+  if (n->next == i) {
+    w->head[slot] = -1;
+    if (slot < WHEEL_DUE)
+      w->bits[slot / WHEEL_SIZE][(slot & WHEEL_MASK) / 64] &=
+          ~(1ULL << (slot & 63));
+  } else {
+    w->nodes[n->prev].next = n->next;
+    w->nodes[n->next].prev = n->prev;
+    if (w->head[slot] == i)
+      w->head[slot] = n->next;
+  }
+  n->slot = -1;
+}
+
+// wheel_place links node i into the slot its deadline belongs to.
+static void wheel_place(struct wheel *w, int i) {
+  long long when = w->nodes[i].when, delta = when - w->now;
+  int level;
+
+  if (delta < 0) {
+    wheel_link(w, i, WHEEL_DUE);
+    return;
+  }
+  // timers beyond the span of the wheel are parked in the farthest slot
+  // and placed again once they are cascaded down.
+  if (delta >= WHEEL_SPAN)
+    when = w->now + WHEEL_SPAN - 1;
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < 1LL << (WHEEL_BITS * (level + 1)))
+      break;
+  wheel_link(w, i,
+             level * WHEEL_SIZE + ((when >> (WHEEL_BITS * level)) & WHEEL_MASK));
+}
+
+// wheel_find returns the first non-empty slot of a level in [from, to),
+// or -1 if there's none.
+static int wheel_find(struct wheel *w, int level, int from, int to) {
+  unsigned long long word;
+  int i;
+  for (i = from; i < to; i = (i | 63) + 1) {
+    word = w->bits[level][i / 64] >> (i & 63);
+    if (word) {
+      i += __builtin_ctzll(word);
+      return i < to ? i : -1;
+    }
+  }
+  return -1;
+}
+
+static int wheel_add(struct wheel *w, struct ev *ev, long long when) {
+  struct wnode *nodes;
+  int i, cap;
+
+  if (w->free < 0) {
+    cap = w->cap + w->cap / 2 + 1;  // 1.5x the current capacity
+    nodes = xalloc(w->nodes, sizeof(*nodes) * cap);
+    if (unlikely(!nodes))
+      return -1;
+    for (i = w->cap; i < cap; i++) {
+      nodes[i].slot = -1;
+      nodes[i].next = i + 1 < cap ? i + 1 : -1;
+    }
+    w->free = w->cap;
+    w->nodes = nodes;
+    w->cap = cap;
+  }
+  i = w->free;
+  w->free = w->nodes[i].next;
+  w->nodes[i].when = when;
+  w->nodes[i].ev = ev;
+  wheel_place(w, i);
+  w->len++;
+  return i;
+}
+
+static void wheel_del(struct wheel *w, int i) {
+  wheel_unlink(w, i);
+  w->nodes[i].next = w->free;
+  w->free = i;
+  w->len--;
+}
+
+// wheel_cascade places timers in the given slot again.
+static void wheel_cascade(struct wheel *w, int slot) {
+  int i;
+  while ((i = w->head[slot]) >= 0) {
+    wheel_unlink(w, i);
+    wheel_place(w, i);
+  }
+}
+
+// wheel_advance processes ticks up to 'now', moving expired timers to the
+// due list. Runs of empty slots in level 0 are skipped at once.
+static void wheel_advance(struct wheel *w, long long now) {
+  long long next;
+  int idx, level, j, i;
+
+  if (!w->len) {
+    if (w->now <= now)
+      w->now = now + 1;
+    return;
+  }
+  while (w->now <= now) {
+    idx = w->now & WHEEL_MASK;
+    if (!idx) {
+      for (level = 1; level < WHEEL_LEVELS; level++) {
+        j = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        wheel_cascade(w, level * WHEEL_SIZE + j);
+        if (j)
+          break;
+      }
+    }
+    while ((i = w->head[idx]) >= 0) {
+      wheel_unlink(w, i);
+      if (w->nodes[i].when <= w->now)
+        wheel_link(w, i, WHEEL_DUE);
+      else
+        wheel_place(w, i);
+    }
+    j = wheel_find(w, 0, idx + 1, WHEEL_SIZE);
+    next = (w->now & ~(long long)WHEEL_MASK) + (j < 0 ? WHEEL_SIZE : j);
+    w->now = next < now + 1 ? next : now + 1;
+  }
+}
+
+// wheel_next saves the earliest time the wheel has to be advanced to in
+// 'when', which is the deadline of the closest timer in level 0 or the
+// time to cascade a slot of an upper level, and returns 1 if the wheel
+// is not empty, or 0 otherwise.
+static int wheel_next(struct wheel *w, long long *when) {
+  long long base, t, min = -1;
+  int level, shift, cur, j;
+
+  if (!w->len)
+    return 0;
+  if (w->head[WHEEL_DUE] >= 0) {
+    *when = w->now - 1;
+    return 1;
+  }
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    shift = WHEEL_BITS * level;
+    base = w->now & ~((1LL << (shift + WHEEL_BITS)) - 1);
+    cur = (w->now >> shift) & WHEEL_MASK;
+    j = wheel_find(w, level, cur, WHEEL_SIZE);
+    if (j >= 0 && base + ((long long)j << shift) < w->now)
+      j = wheel_find(w, level, cur + 1, WHEEL_SIZE);
+    if (j < 0) {
+      j = wheel_find(w, level, 0, cur + 1);
+      if (j < 0)
+        continue;
+      base += 1LL << (shift + WHEEL_BITS);  // the next rotation.
+    }
+    t = base + ((long long)j << shift);
+    if (min < 0 || t < min)
+      min = t;
+  }
+  *when = min;
+  return 1;
+}
+
+// wheel_pop removes the first expired timer and returns it, or NULL if
+// there's none.
+static struct ev *wheel_pop(struct wheel *w) {
+  int i = w->head[WHEEL_DUE];
+  if (i < 0)
+    return NULL;
+  wheel_del(w, i);
+  return w->nodes[i].ev;
+}
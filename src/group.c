@@ -0,0 +1,125 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "x/ev.h"
+#include "x/mm.h"
+
+struct worker {
+  pthread_t tid;
+  struct loop *loop;
+  struct group *group;
+  int id;
+  int err;  // what init or loop_wait returns.
+};
+
+struct group {
+  int n;
+  int started;  // the number of threads spawned.
+  int (*init)(struct loop *, int, void *);
+  void *ud;
+  struct worker workers[];
+};
+
+// pin binds the calling thread to a CPU, it is best-effort since the
+// process may be restricted to fewer CPUs.
+static void pin(int id) {
+#ifdef __linux__
+  cpu_set_t set;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu <= 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(id % ncpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void *run(void *arg) {
+  struct worker *w = arg;
+  struct group *g = w->group;
+  pin(w->id);
+  if (g->init && (w->err = g->init(w->loop, w->id, g->ud)) < 0)
+    return NULL;
+  w->err = loop_wait(w->loop);
+  return NULL;
+}
+
+struct group *group_alloc(int n, int backlog, int flags) {
+  struct group *g;
+  int i;
+
+  if (n <= 0)
+    return NULL;
+  g = xalloc(NULL, sizeof(*g) + sizeof(struct worker) * n);
+  if (unlikely(!g))
+    return NULL;
+  memset(g, 0, sizeof(*g) + sizeof(struct worker) * n);
+  g->n = n;
+  for (i = 0; i < n; i++) {
+    g->workers[i].group = g;
+    g->workers[i].id = i;
+    g->workers[i].loop = loop_alloc_flags(backlog, flags);
+    if (!g->workers[i].loop)
+      goto err;
+  }
+  return g;
+
+err:
+  group_free(g);
+  return NULL;
+}
+
+struct loop *group_loop(struct group *g, int i) {
+  return (i >= 0 && i < g->n) ? g->workers[i].loop : NULL;
+}
+
+int group_start(struct group *g, int (*init)(struct loop *, int, void *),
+                void *ud) {
+  struct worker *w;
+  g->init = init;
+  g->ud = ud;
+  for (; g->started < g->n; g->started++) {
+    w = &g->workers[g->started];
+    if (pthread_create(&w->tid, NULL, run, w) != 0) {
+      group_stop(g);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void group_stop(struct group *g) {
+  int i;
+  for (i = 0; i < g->started; i++)
+    loop_break(g->workers[i].loop);
+}
+
+int group_join(struct group *g) {
+  int i, err = 0, polled = 0;
+  for (i = 0; i < g->started; i++) {
+    pthread_join(g->workers[i].tid, NULL);
+    if (g->workers[i].err < 0 && !err)
+      err = g->workers[i].err;
+    else if (g->workers[i].err > 0)
+      polled += g->workers[i].err;
+  }
+  g->started = 0;
+  return err ? err : polled;
+}
+
+void group_free(struct group *g) {
+  int i;
+  for (i = 0; i < g->n; i++)
+    if (g->workers[i].loop)
+      loop_free(g->workers[i].loop);
+  xfree(g);
+}
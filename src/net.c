@@ -5,9 +5,17 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "x/net.h"
 
+// microseconds to busy poll a socket created with NET_BUSY_POLL.
+#define NET_BUSY_POLL_USEC 50
+
+#if defined(__linux__) && !defined(SO_PREFER_BUSY_POLL)
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 static int __socket(int family, int socktype, int protocol) {
   int sockfd;
 
@@ -39,7 +47,8 @@ static int is_ipv6(const char *p) {
   return -1;
 }
 
-static int __inet_bind(const char *host, unsigned short port, int socktype) {
+static int __inet_bind(const char *host, unsigned short port, int socktype,
+                       int flags) {
   char _port[6];
   snprintf(_port, 6, "%u", port);
 
@@ -57,10 +66,23 @@ static int __inet_bind(const char *host, unsigned short port, int socktype) {
   if ((err = getaddrinfo(host, _port, &hint, &ai)) != 0)
     return err;
 
-  int sockfd = -1;
+  int sockfd = -1, on = 1;
   for (p = ai; p != NULL; p = p->ai_next) {
     if ((sockfd = __socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
       continue;
+#ifdef SO_REUSEPORT
+    if ((flags & NET_REUSEPORT) &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+      perror("setsockopt(SO_REUSEPORT)");
+      close(sockfd);
+      sockfd = -1;
+      continue;
+    }
+#endif
+    // accepted sockets inherit it from the listener.
+    if ((flags & NET_BUSY_POLL) &&
+        set_busy_poll(sockfd, NET_BUSY_POLL_USEC) < 0)
+      perror("set_busy_poll");
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) < 0) {
       perror("bind");
       continue;
@@ -131,8 +153,26 @@ void set_cloexec(int sockfd) {
     fcntl(sockfd, F_SETFD, new);
 }
 
+int set_busy_poll(int sockfd, int usec) {
+#ifdef SO_BUSY_POLL
+  int on = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) < 0)
+    return -1;
+  // best effort, older kernels busy poll without it.
+  setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof on);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 int udp_bind(const char *host, unsigned short port) {
-  return __inet_bind(host, port, SOCK_DGRAM);
+  return __inet_bind(host, port, SOCK_DGRAM, 0);
+}
+
+int udp_bind_flags(const char *host, unsigned short port, int flags) {
+  return __inet_bind(host, port, SOCK_DGRAM, flags);
 }
 
 int udp_connect(int sockfd, const char *host, unsigned short port) {
@@ -140,8 +180,12 @@ int udp_connect(int sockfd, const char *host, unsigned short port) {
 }
 
 int tcp_listen(const char *host, unsigned short port) {
+  return tcp_listen_flags(host, port, 0);
+}
+
+int tcp_listen_flags(const char *host, unsigned short port, int flags) {
   int sockfd;
-  if ((sockfd = __inet_bind(host, port, SOCK_STREAM)) < 0) {
+  if ((sockfd = __inet_bind(host, port, SOCK_STREAM, flags)) < 0) {
     return sockfd;
   }
   if (listen(sockfd, 5) < 0) {
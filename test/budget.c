@@ -0,0 +1,129 @@
+// Tests of the IO budgets of an iteration and of loop_yield.
+
+#include <fcntl.h>
+
+#include "test.h"
+
+// struct reader is an IO event which reads a byte per call, returns what
+// read returns like echo.c does, and yields if 'yield' is set and it got
+// one.
+struct reader {
+  struct ev ev;
+  int calls;
+  int bytes;
+  int yield;
+};
+
+static int reader_cb(struct loop *L, struct ev *ev) {
+  struct reader *r = container_of(ev, struct reader, ev);
+  char c;
+  ssize_t n = read(ev->fd, &c, 1);
+  r->calls++;
+  if (n == 1) {
+    r->bytes++;
+    if (r->yield)
+      loop_yield(L, ev);
+  }
+  return n < 0 ? 0 : n;
+}
+
+static void reader_init(struct reader *r, int fd, int events) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  r->ev = (struct ev){.fd = fd, .events = events, .callback = reader_cb};
+  r->calls = r->bytes = r->yield = 0;
+}
+
+// test_positive checks that a callback returning a positive number, e.g.
+// the bytes it read, is not called again without the fd being ready.
+static void test_positive(struct loop *L) {
+  struct reader r;
+  int sv[2];
+
+  test_pair(sv);
+  reader_init(&r, sv[0], EV_READ);
+  CHECK(loop_add(L, &r.ev) == 0);
+  CHECK(write(sv[1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(r.calls == 1);
+  test_dispatch(L, 20);
+  CHECK(r.calls == 1);
+  loop_del(L, &r.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_yield checks that a yielded event is dispatched again in the same
+// iteration, and again by the next ones until it stops yielding, even if
+// it is edge-triggered and the kernel doesn't report it again.
+static void test_yield(struct loop *L) {
+  struct loop_stats st;
+  struct reader r;
+  int sv[2], i;
+
+  test_pair(sv);
+  reader_init(&r, sv[0], EV_READ | EV_ET);
+  r.yield = 1;
+  CHECK(loop_add(L, &r.ev) == 0);
+  CHECK(write(sv[1], "xyz", 3) == 3);
+  test_dispatch(L, 100);
+  CHECK(r.calls == 2);
+  for (i = 0; i < 10 && r.bytes < 3; i++)
+    test_dispatch(L, 20);
+  CHECK(r.bytes == 3);
+  CHECK(loop_stats(L, &st) == 0);
+  CHECK(st.yields >= 3);
+  CHECK(loop_yield(L, &r.ev) == 0);
+  loop_del(L, &r.ev);
+  CHECK(loop_yield(L, &r.ev) < 0);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_io_budget checks that IO events beyond LOOP_OPT_IO_BUDGET are left
+// to the next iteration, except those of EV_PRIO_HIGH which neither wait
+// for nor use up the budget.
+static void test_io_budget(struct loop *L) {
+  struct reader r[3];
+  int sv[3][2], i;
+
+  CHECK(loop_setopt(L, LOOP_OPT_IO_BUDGET, 1) == 0);
+  for (i = 0; i < 3; i++) {
+    test_pair(sv[i]);
+    reader_init(&r[i], sv[i][0], EV_READ | (i ? 0 : EV_PRIO_HIGH));
+    CHECK(loop_add(L, &r[i].ev) == 0);
+  }
+  r[0].yield = 1;
+  CHECK(write(sv[0][1], "xy", 2) == 2);
+  CHECK(write(sv[1][1], "x", 1) == 1);
+  CHECK(write(sv[2][1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  // r[0] is called again by the pass over the ready list, though the
+  // budget is used up by one of the others.
+  CHECK(r[0].bytes == 2);
+  CHECK(r[1].calls + r[2].calls == 1);
+  test_dispatch(L, 100);
+  CHECK(r[1].bytes == 1 && r[2].bytes == 1);
+  CHECK(loop_setopt(L, LOOP_OPT_IO_BUDGET, 0) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_IO_BUDGET, 1 << 30) == 0);
+  for (i = 0; i < 3; i++) {
+    loop_del(L, &r[i].ev);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+}
+
+int main(void) {
+  struct loop *L;
+  const char *backend;
+
+  if (!(L = loop_alloc_flags(4, LOOP_STATS))) {
+    perror("loop_alloc_flags");
+    return 1;
+  }
+  backend = loop_backend(L);
+  test_positive(L);
+  test_yield(L);
+  test_io_budget(L);
+  loop_free(L);
+  return test_done("budget", backend);
+}
@@ -0,0 +1,177 @@
+// Tests of the fd table, see fdt_get.
+
+#include <errno.h>
+
+#include "test.h"
+
+// test_negative checks that an IO event of a negative fd, e.g. from a
+// failed tcp_listen, is refused rather than indexing the fd table.
+static void test_negative(struct loop *L) {
+  struct probe p;
+
+  probe_init(&p, -1, EV_READ);
+  errno = 0;
+  CHECK(loop_add(L, &p.ev) < 0 && errno == EBADF);
+  CHECK(loop_mod(L, &p.ev) < 0);
+  CHECK(loop_del(L, &p.ev) == 0);
+  probe_init(&p, -4096, EV_WRITE);
+  CHECK(loop_add(L, &p.ev) < 0);
+}
+
+// test_exclusive checks that the events of an EV_EXCLUSIVE fd can be
+// changed, which epoll refuses to modify, and that it can't be EV_ONCE.
+static void test_exclusive(struct loop *L) {
+  struct probe p;
+  int sv[2];
+
+  test_pair(sv);
+  probe_init(&p, sv[0], EV_WRITE | EV_EXCLUSIVE);
+  CHECK(loop_add(L, &p.ev) == 0);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 1 && p.ev.revents == EV_WRITE);
+  p.ev.events = EV_READ | EV_EXCLUSIVE;  // not readable yet
+  CHECK(loop_mod(L, &p.ev) == 0);
+  test_dispatch(L, 20);
+  CHECK(p.calls == 1);
+  CHECK(write(sv[1], "x", 1) == 1);
+  p.drain = 1;
+  test_dispatch(L, 100);
+  CHECK(p.calls == 2 && p.ev.revents == EV_READ);
+  p.ev.events = EV_READ | EV_EXCLUSIVE | EV_ONCE;
+  errno = 0;
+  CHECK(loop_mod(L, &p.ev) < 0 && errno == EINVAL);
+  loop_del(L, &p.ev);
+  errno = 0;
+  CHECK(loop_add(L, &p.ev) < 0 && errno == EINVAL);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// ctl_calls returns the calls made to the backend for loop_ctl so far.
+static unsigned long long ctl_calls(struct loop *L) {
+  struct loop_stats st;
+  loop_stats(L, &st);
+  return st.ctl_calls;
+}
+
+// test_readd checks that an fd added again by the same event, e.g. to
+// change its events, is modified with one call, even if it was closed
+// and opened again, and that one added again by another event is
+// registered anew.
+static void test_readd(struct loop *L) {
+  struct probe p, q;
+  unsigned long long n;
+  int sv[2], sv2[2], fd;
+
+  test_pair(sv);
+  fd = sv[0];
+  probe_init(&p, fd, EV_READ);
+  CHECK(loop_add(L, &p.ev) == 0);
+  test_dispatch(L, 20);
+  n = ctl_calls(L);
+  p.ev.events = EV_READ | EV_WRITE;
+  CHECK(loop_add(L, &p.ev) == 0);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 1 && p.ev.revents == EV_WRITE);
+  CHECK(ctl_calls(L) == n + 1);
+
+  // closed and opened again without loop_del.
+  test_pair(sv2);
+  CHECK(dup2(sv2[0], fd) == fd);
+  n = ctl_calls(L);
+  p.ev.events = EV_READ;
+  CHECK(loop_add(L, &p.ev) == 0);
+  test_dispatch(L, 20);
+  CHECK(p.calls == 1);  // not failed
+  p.drain = 1;
+  CHECK(write(sv2[1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 2 && p.ev.revents == EV_READ);
+  CHECK(ctl_calls(L) == n + 1);
+
+  // and by another event.
+  close(sv2[0]);
+  close(sv2[1]);
+  test_pair(sv2);
+  CHECK(dup2(sv2[0], fd) == fd);
+  probe_init(&q, fd, EV_READ);
+  q.drain = 1;
+  n = ctl_calls(L);
+  CHECK(loop_add(L, &q.ev) == 0);
+  CHECK(write(sv2[1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 2 && q.calls == 1);
+  CHECK(ctl_calls(L) == n + 2);
+  loop_del(L, &q.ev);
+  close(fd);
+  close(sv[1]);
+  close(sv2[0]);
+  close(sv2[1]);
+}
+
+// struct churn is an IO event whose callback deletes the event of
+// another fd and adds one of its own for it, 'n' times over.
+struct churn {
+  struct ev ev;
+  struct ev *victim;
+  struct probe *fresh;
+  int n;
+};
+
+static int churn_cb(struct loop *L, struct ev *ev) {
+  struct churn *c = container_of(ev, struct churn, ev);
+  int i;
+  for (i = 0; i < c->n; i++) {
+    loop_del(L, i ? &c->fresh[(i - 1) & 1].ev : c->victim);
+    loop_add(L, &c->fresh[i & 1].ev);
+  }
+  return 0;
+}
+
+// test_seq checks that an event fired but deleted by a callback before
+// it is dispatched is dropped, however many times its fd is deleted and
+// added again by then.
+static void test_seq(struct loop *L) {
+  struct churn c;
+  struct probe victim, fresh[2];
+  int sv[2], sv2[2];
+
+  test_pair(sv);
+  test_pair(sv2);
+  c.ev = (struct ev){.fd = sv[0], .events = EV_WRITE | EV_PRIO_HIGH};
+  c.ev.callback = churn_cb;
+  c.victim = &victim.ev;
+  c.fresh = fresh;
+  c.n = 256;
+  probe_init(&victim, sv2[0], EV_WRITE);
+  probe_init(&fresh[0], sv2[0], EV_WRITE);
+  probe_init(&fresh[1], sv2[0], EV_WRITE);
+  CHECK(loop_add(L, &victim.ev) == 0);
+  CHECK(loop_add(L, &c.ev) == 0);
+  test_dispatch(L, 100);
+  CHECK(victim.calls == 0);
+  CHECK(fresh[0].calls == 0 && fresh[1].calls == 0);
+  loop_del(L, &c.ev);
+  loop_del(L, &fresh[(c.n - 1) & 1].ev);
+  close(sv[0]);
+  close(sv[1]);
+  close(sv2[0]);
+  close(sv2[1]);
+}
+
+int main(void) {
+  struct loop *L;
+  const char *backend;
+
+  if (!(L = loop_alloc_flags(4, LOOP_STATS))) {
+    perror("loop_alloc_flags");
+    return 1;
+  }
+  backend = loop_backend(L);
+  test_negative(L);
+  test_exclusive(L);
+  test_readd(L);
+  test_seq(L);
+  loop_free(L);
+  return test_done("fd", backend);
+}
@@ -0,0 +1,100 @@
+// Tests of loop groups.
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define THREADS 3
+
+struct worker {
+  struct probe idle;  // never ready, keeps loop_wait on.
+  int sv[2];
+  pthread_t tid;     // the thread of the loop, set by init.
+  int ran;           // set by a task posted to the loop.
+};
+
+static struct worker workers[THREADS];
+static int inited;
+
+static int init(struct loop *L, int i, void *ud) {
+  struct worker *w = &workers[i];
+  if (ud)  // fails the given worker.
+    return i == *(int *)ud ? -7 : 0;
+  test_pair(w->sv);
+  probe_init(&w->idle, w->sv[0], EV_READ);
+  w->tid = pthread_self();
+  if (loop_add(L, &w->idle.ev) < 0)
+    return -1;
+  __atomic_add_fetch(&inited, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void task(struct loop *L, void *arg) {
+  struct worker *w = arg;
+  __atomic_store_n(&w->ran, pthread_equal(w->tid, pthread_self()) ? 1 : -1,
+                   __ATOMIC_RELEASE);
+}
+
+// ran returns the number of workers which ran the task.
+static int ran(void) {
+  int i, n = 0;
+  for (i = 0; i < THREADS; i++)
+    n += __atomic_load_n(&workers[i].ran, __ATOMIC_ACQUIRE) != 0;
+  return n;
+}
+
+// test_start checks that every loop of a group runs init and then
+// loop_wait on its own thread, until group_stop.
+static void test_start(void) {
+  struct group *g;
+  int i = 0;
+
+  CHECK((g = group_alloc(THREADS, 4, 0)) != NULL);
+  CHECK(group_loop(g, THREADS) == NULL && group_loop(g, -1) == NULL);
+  CHECK(group_start(g, init, NULL) == 0);
+  while (__atomic_load_n(&inited, __ATOMIC_ACQUIRE) < THREADS && i++ < 5000)
+    usleep(1000);
+  CHECK(inited == THREADS);
+  for (i = 0; i < THREADS; i++)
+    CHECK(loop_post(group_loop(g, i), task, &workers[i]) == 0);
+  for (i = 0; ran() < THREADS && i < 5000; i++)
+    usleep(1000);
+  for (i = 0; i < THREADS; i++)
+    CHECK(workers[i].ran == 1);
+  group_stop(g);
+  CHECK(group_join(g) >= 0);
+  for (i = 0; i < THREADS; i++) {
+    loop_del(group_loop(g, i), &workers[i].idle.ev);
+    close(workers[i].sv[0]);
+    close(workers[i].sv[1]);
+  }
+  group_free(g);
+}
+
+// test_init_error checks that group_join returns the error of an init.
+static void test_init_error(void) {
+  struct group *g;
+  int fail = 1;
+
+  CHECK(group_alloc(0, 4, 0) == NULL);
+  CHECK((g = group_alloc(THREADS, 4, 0)) != NULL);
+  CHECK(group_start(g, init, &fail) == 0);
+  CHECK(group_join(g) == -7);
+  group_free(g);
+}
+
+int main(void) {
+  const char *backend;
+  struct loop *L;
+
+  alarm(10);  // a group never stopping fails the test.
+  if (!(L = loop_alloc(1))) {
+    perror("loop_alloc");
+    return 1;
+  }
+  backend = loop_backend(L);
+  loop_free(L);
+  test_start();
+  test_init_error();
+  return test_done("group", backend);
+}
@@ -0,0 +1,199 @@
+// Tests of the poll(2) backend, whose slots of watched fds are moved
+// around on removal, see ev_poll.c.
+
+#include <sys/resource.h>
+
+#include "test.h"
+
+// test_level checks that an fd stays ready until it is drained.
+static void test_level(struct loop *L) {
+  struct probe p;
+  int sv[2];
+
+  test_pair(sv);
+  probe_init(&p, sv[0], EV_READ);
+  p.drain = 1;
+  CHECK(loop_add(L, &p.ev) == 0);
+  CHECK(write(sv[1], "xy", 2) == 2);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 1);
+  test_dispatch(L, 100);  // one byte left
+  CHECK(p.calls == 2);
+  test_dispatch(L, 20);  // drained
+  CHECK(p.calls == 2);
+  loop_del(L, &p.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_once checks that an EV_ONCE event fires once until it is re-armed
+// by loop_mod, though the fd is still ready.
+static void test_once(struct loop *L) {
+  struct probe p;
+  int sv[2];
+
+  test_pair(sv);
+  probe_init(&p, sv[0], EV_READ | EV_ONCE);
+  CHECK(loop_add(L, &p.ev) == 0);
+  CHECK(write(sv[1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 1);
+  test_dispatch(L, 20);
+  CHECK(p.calls == 1);
+  CHECK(loop_mod(L, &p.ev) == 0);
+  test_dispatch(L, 100);
+  CHECK(p.calls == 2);
+  loop_del(L, &p.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_swap deletes the fd in the middle and then the first one, whose
+// slots are filled by the last one, and checks that the fds left fire
+// their own events.
+static void test_swap(struct loop *L) {
+  struct probe p[4];
+  int sv[4][2], i;
+
+  for (i = 0; i < 4; i++) {
+    test_pair(sv[i]);
+    probe_init(&p[i], sv[i][0], EV_READ);
+    p[i].drain = 1;
+    CHECK(loop_add(L, &p[i].ev) == 0);
+  }
+  test_dispatch(L, 20);  // registered
+  loop_del(L, &p[1].ev);  // p[3] moves into its slot
+  p[3].ev.events = EV_WRITE;  // always ready
+  p[3].drain = 0;
+  CHECK(loop_mod(L, &p[3].ev) == 0);
+  test_dispatch(L, 100);
+  CHECK(p[0].calls == 0 && p[2].calls == 0 && p[3].calls == 1);
+  p[3].ev.events = EV_READ;
+  CHECK(loop_mod(L, &p[3].ev) == 0);
+  p[3].calls = 0;
+  p[3].drain = 1;
+  for (i = 0; i < 4; i++)
+    CHECK(write(sv[i][1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p[0].calls == 1 && p[1].calls == 0);
+  CHECK(p[2].calls == 1 && p[3].calls == 1);
+  loop_del(L, &p[0].ev);  // p[2] moves into its slot
+  for (i = 0; i < 4; i++)
+    CHECK(write(sv[i][1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p[0].calls == 1 && p[1].calls == 0);
+  CHECK(p[2].calls == 2 && p[3].calls == 2);
+  loop_del(L, &p[3].ev);  // the last one
+  CHECK(write(sv[2][1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  CHECK(p[2].calls == 3 && p[3].calls == 2);
+  loop_del(L, &p[2].ev);
+  for (i = 0; i < 4; i++) {
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+}
+
+// test_sparse watches fds scattered up to the limit of open files.
+static void test_sparse(struct loop *L) {
+  struct rlimit rl;
+  struct probe p[3];
+  int fds[3], sv[2], i, max;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  max = rl.rlim_cur > 65536 ? 65536 : (int)rl.rlim_cur;
+  fds[0] = max / 4;
+  fds[1] = max / 2;
+  fds[2] = max - 1;
+  test_pair(sv);
+  for (i = 0; i < 3; i++) {
+    CHECK(dup2(sv[0], fds[i]) == fds[i]);
+    probe_init(&p[i], fds[i], EV_READ);
+    CHECK(loop_add(L, &p[i].ev) == 0);
+  }
+  CHECK(write(sv[1], "x", 1) == 1);
+  test_dispatch(L, 100);
+  for (i = 0; i < 3; i++)
+    CHECK(p[i].calls == 1);
+  for (i = 0; i < 3; i++) {
+    loop_del(L, &p[i].ev);
+    close(fds[i]);
+  }
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// struct stamp is an event recording the order its callback is called in.
+struct stamp {
+  struct ev ev;
+  int at;  // the order it was called in, from 1, or 0.
+};
+
+static int stamps;
+
+static int stamp_cb(struct loop *L, struct ev *ev) {
+  struct stamp *s = container_of(ev, struct stamp, ev);
+  s->at = ++stamps;
+  return 0;
+}
+
+// test_prio checks that IO events of EV_PRIO_HIGH are dispatched first,
+// then the others, then timer events, and those of EV_PRIO_LOW last, no
+// more of which than LOOP_OPT_LOW_BUDGET per iteration.
+static void test_prio(struct loop *L) {
+  static const int prio[4] = {EV_PRIO_LOW, EV_PRIO_LOW, 0, EV_PRIO_HIGH};
+  struct stamp s[4], t;
+  int sv[4][2], i, d;
+
+  for (i = 0; i < 4; i++) {  // added in the reverse order of priority.
+    test_pair(sv[i]);
+    s[i].ev = (struct ev){.fd = sv[i][0], .events = EV_WRITE | prio[i]};
+    s[i].ev.callback = stamp_cb;
+    CHECK(loop_add(L, &s[i].ev) == 0);
+  }
+  t.ev = (struct ev){.fd = -1, .events = EV_TIMER, .ms = 1};
+  t.ev.callback = stamp_cb;
+  CHECK(loop_add(L, &t.ev) == 0);
+  CHECK(loop_setopt(L, LOOP_OPT_LOW_BUDGET, 1) == 0);
+  usleep(2000);
+  for (i = 0; i < 4; i++)
+    s[i].at = 0;
+  t.at = stamps = 0;
+  loop_dispatch(L, EV_ALL);
+  CHECK(s[3].at == 1);  // EV_PRIO_HIGH
+  CHECK(s[2].at == 2);
+  CHECK(t.at == 3);
+  CHECK(s[0].at + s[1].at == 4);  // one of EV_PRIO_LOW, the other later.
+  d = s[0].at ? 1 : 0;
+  stamps = 10;
+  loop_dispatch(L, EV_IO);
+  CHECK(s[d].at > 10);
+  CHECK(loop_setopt(L, LOOP_OPT_LOW_BUDGET, 0) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_LOW_BUDGET, 1 << 30) == 0);
+  for (i = 0; i < 4; i++) {
+    loop_del(L, &s[i].ev);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+}
+
+int main(void) {
+  struct rlimit rl;
+  struct loop *L;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  if (!(L = loop_alloc_flags(4, LOOP_POLL))) {
+    perror("loop_alloc_flags");
+    return 1;
+  }
+  test_level(L);
+  test_once(L);
+  test_swap(L);
+  test_sparse(L);
+  test_prio(L);
+  loop_free(L);
+  return test_done("poll", "poll");
+}
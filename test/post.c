@@ -0,0 +1,93 @@
+// Tests of loop_post and loop_break called by other threads.
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define POSTS 1000
+
+struct poster {
+  struct loop *L;
+  int id;
+  int last;  // the last number run of this poster, or -1.
+  int runs;
+  int order_ok;
+  int *done;  // posters whose tasks have all run.
+};
+
+static struct poster posters[2];
+
+// run checks that tasks of a poster run in the order posted.
+static void run(struct loop *L, void *arg) {
+  long v = (long)arg;
+  struct poster *p = &posters[v % 2];
+  if (v / 2 != p->last + 1)
+    p->order_ok = 0;
+  p->last = v / 2;
+  if (++p->runs == POSTS)
+    __atomic_add_fetch(p->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *post_all(void *arg) {
+  struct poster *p = arg;
+  int i;
+  for (i = 0; i < POSTS; i++)
+    if (loop_post(p->L, run, (void *)(long)(i * 2 + p->id)) < 0)
+      p->order_ok = 0;
+  return NULL;
+}
+
+// breaker stops the loop once the tasks of both posters have run.
+static void *breaker(void *arg) {
+  struct poster *p = arg;
+  while (__atomic_load_n(p->done, __ATOMIC_ACQUIRE) < 2)
+    usleep(1000);
+  loop_break(p->L);
+  return NULL;
+}
+
+// test_post checks that tasks posted by other threads wake up a loop
+// blocked in loop_wait, run in the order each thread posted them, and
+// that loop_break called by another thread makes loop_wait return.
+static void test_post(struct loop *L) {
+  pthread_t t[3];
+  struct probe idle;
+  int sv[2], i, done = 0;
+
+  test_pair(sv);
+  probe_init(&idle, sv[0], EV_READ);  // never ready, keeps loop_wait on.
+  CHECK(loop_add(L, &idle.ev) == 0);
+  for (i = 0; i < 2; i++) {
+    posters[i] = (struct poster){.L = L, .id = i, .last = -1, .order_ok = 1};
+    posters[i].done = &done;
+  }
+  CHECK(pthread_create(&t[0], NULL, breaker, &posters[0]) == 0);
+  CHECK(pthread_create(&t[1], NULL, post_all, &posters[0]) == 0);
+  CHECK(pthread_create(&t[2], NULL, post_all, &posters[1]) == 0);
+  loop_wait(L);
+  for (i = 0; i < 3; i++)
+    pthread_join(t[i], NULL);
+  for (i = 0; i < 2; i++) {
+    CHECK(posters[i].runs == POSTS);
+    CHECK(posters[i].order_ok);
+  }
+  CHECK(idle.calls == 0);
+  loop_del(L, &idle.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(void) {
+  struct loop *L;
+  const char *backend;
+
+  alarm(10);  // loop_wait never returning fails the test.
+  if (!(L = loop_alloc(4))) {
+    perror("loop_alloc");
+    return 1;
+  }
+  backend = loop_backend(L);
+  test_post(L);
+  loop_free(L);
+  return test_done("post", backend);
+}
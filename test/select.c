@@ -0,0 +1,58 @@
+// Tests of the select(2) backend, which can't watch fds beyond
+// FD_SETSIZE.
+
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#include "test.h"
+
+// test_limit adds an fd beyond FD_SETSIZE, which is refused once the
+// change is applied and reported to its callback, and checks that the
+// polls after still watch the other fds.
+static void test_limit(struct loop *L) {
+  struct probe hi, lo;
+  int sv[2], fd = FD_SETSIZE + 7, i;
+
+  test_pair(sv);
+  if (dup2(sv[0], fd) != fd) {
+    perror("dup2");
+    test_failures++;
+    return;
+  }
+  probe_init(&hi, fd, EV_READ);
+  probe_init(&lo, sv[0], EV_READ);
+  lo.drain = 1;
+  CHECK(loop_add(L, &hi.ev) == 0);
+  CHECK(loop_add(L, &lo.ev) == 0);
+  test_dispatch(L, 20);
+  CHECK(hi.calls == 1);  // refused
+  CHECK(lo.calls == 0);
+  for (i = 1; i <= 3; i++) {
+    CHECK(write(sv[1], "x", 1) == 1);
+    test_dispatch(L, 100);
+    CHECK(lo.calls == i);
+  }
+  CHECK(hi.calls == 1);
+  loop_del(L, &hi.ev);
+  loop_del(L, &lo.ev);
+  close(fd);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(void) {
+  struct rlimit rl;
+  struct loop *L;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  if (!(L = loop_alloc_flags(4, LOOP_SELECT))) {
+    perror("loop_alloc_flags");
+    return 1;
+  }
+  test_limit(L);
+  loop_free(L);
+  return test_done("select", "select");
+}
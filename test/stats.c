@@ -0,0 +1,204 @@
+// Tests of loop_stats and of the options whose effect it counts.
+
+#include "test.h"
+
+// hist_sum returns the number of samples of a histogram.
+static unsigned long long hist_sum(const unsigned long long *h) {
+  unsigned long long n = 0;
+  int i;
+  for (i = 0; i < LOOP_STATS_BUCKETS; i++)
+    n += h[i];
+  return n;
+}
+
+// test_stats checks that the counters and histograms of loop_stats
+// record what a dispatch did.
+static void test_stats(void) {
+  struct loop_stats s;
+  struct probe p, t;
+  struct loop *L;
+  int sv[2];
+
+  CHECK((L = loop_alloc(4)) != NULL);
+  CHECK(loop_stats(L, &s) == -1);  // not created with LOOP_STATS.
+  loop_free(L);
+
+  CHECK((L = loop_alloc_flags(4, LOOP_STATS)) != NULL);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.iterations == 0 && s.ctl_add == 0 && s.ctl_calls == 0);
+  CHECK(hist_sum(s.poll_ns) == 0 && hist_sum(s.callback_ns) == 0);
+
+  test_pair(sv);
+  probe_init(&p, sv[0], EV_READ);
+  p.drain = 1;
+  probe_init(&t, -1, EV_TIMER);
+  t.ev.ms = 1;
+  CHECK(loop_add(L, &p.ev) == 0);
+  CHECK(loop_add(L, &t.ev) == 0);
+  CHECK(write(sv[1], "x", 1) == 1);
+  CHECK(loop_dispatch(L, EV_ALL) >= 1);
+  while (t.calls == 0 && loop_dispatch(L, EV_ALL) >= 0)
+    ;
+  CHECK(p.calls == 1 && t.calls == 1);
+  loop_del(L, &p.ev);
+
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.iterations >= 2);
+  CHECK(s.ctl_add == 2 && s.ctl_del == 1);  // timer events count too.
+  CHECK(s.ctl_calls >= 1);
+  CHECK(hist_sum(s.poll_ns) == s.iterations);
+  CHECK(hist_sum(s.events) == s.iterations);
+  CHECK(s.events[1] >= 1);  // the poll which fired the read event.
+  CHECK(hist_sum(s.callback_ns) == 2);
+  CHECK(hist_sum(s.lateness_ns) == 1);
+  loop_free(L);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_busy_poll checks that LOOP_OPT_BUSY_POLL polls without blocking
+// before it blocks, and gets the events ready by then.
+static void test_busy_poll(void) {
+  unsigned long long polls;
+  struct loop_stats s;
+  struct probe p;
+  struct loop *L;
+  int sv[2];
+
+  CHECK((L = loop_alloc_flags(4, LOOP_STATS)) != NULL);
+  CHECK(loop_setopt(L, LOOP_OPT_BUSY_POLL, -1) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_BUSY_POLL, 1000) == 0);
+  test_pair(sv);
+  probe_init(&p, sv[0], EV_READ);
+  p.drain = 1;
+  CHECK(loop_add(L, &p.ev) == 0);
+  CHECK(write(sv[1], "x", 1) == 1);
+  CHECK(loop_dispatch(L, EV_ALL) == 1);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.busy_polls >= 1 && s.busy_hits == 1 && s.busy_blocks == 0);
+
+  // nothing comes in while spinning, so it blocks until the timer.
+  test_dispatch(L, 5);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.busy_polls >= 2 && s.busy_hits == 1 && s.busy_blocks == 1);
+  CHECK(p.calls == 1);
+
+  polls = s.busy_polls;
+  CHECK(loop_setopt(L, LOOP_OPT_BUSY_POLL, 0) == 0);  // turned off.
+  test_dispatch(L, 1);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.busy_polls == polls && s.busy_blocks == 1);
+  loop_del(L, &p.ev);
+  loop_free(L);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_slack checks that LOOP_OPT_SLACK makes timer events due within
+// the same slack fire together, rather than each waking the loop up.
+static void test_slack(void) {
+  long long slack = 100, now, window, ms;
+  struct probe t[3];
+  struct loop *L;
+  int i;
+
+  CHECK((L = loop_alloc(4)) != NULL);
+  CHECK(loop_setopt(L, LOOP_OPT_SLACK, -1) < 0);
+  for (i = 0; i < 3; i++) {
+    probe_init(&t[i], -1, EV_TIMER);
+    t[i].ev.ms = 5 * (i + 1);
+    CHECK(loop_add(L, &t[i].ev) == 0);
+  }
+  CHECK(loop_dispatch(L, EV_ALL) == 1);  // no slack, one at a time.
+  for (i = 0; i < 3; i++)
+    loop_del(L, &t[i].ev);
+
+  // the loop wakes up on a multiple of the slack, so the timer events
+  // are put between the next two multiples of it.
+  CHECK(loop_setopt(L, LOOP_OPT_SLACK, slack * 1000) == 0);
+  loop_dispatch(L, EV_TIMER);  // updates loop_now.
+  now = loop_now(L);
+  slack *= 1000000;
+  window = (now / slack + 1) * slack;
+  ms = (window - now + 999999) / 1000000;
+  for (i = 0; i < 3; i++) {
+    probe_init(&t[i], -1, EV_TIMER);
+    t[i].ev.ms = ms + 10 + 20 * i;
+    CHECK(loop_add(L, &t[i].ev) == 0);
+  }
+  CHECK(loop_dispatch(L, EV_ALL) == 3);
+  for (i = 0; i < 3; i++)
+    CHECK(t[i].calls == 1);
+  loop_free(L);
+}
+
+// test_batch checks that LOOP_OPT_BATCH delays a poll after one which
+// got fewer IO events than the batch, and counts those which got it.
+static void test_batch(void) {
+  struct loop_stats s;
+  struct probe p[4];
+  struct loop *L;
+  int sv[4][2], i;
+
+  CHECK((L = loop_alloc_flags(8, LOOP_STATS)) != NULL);
+  CHECK(loop_setopt(L, LOOP_OPT_BATCH, -1) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_BATCH_DELAY, 0) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_BATCH_DELAY, -1) < 0);
+  CHECK(loop_setopt(L, LOOP_OPT_BATCH, 4) == 0);
+  CHECK(loop_setopt(L, LOOP_OPT_BATCH_DELAY, 2000) == 0);
+  for (i = 0; i < 4; i++) {
+    test_pair(sv[i]);
+    probe_init(&p[i], sv[i][0], EV_READ);
+    p[i].drain = 1;
+    CHECK(loop_add(L, &p[i].ev) == 0);
+  }
+
+  // an idle loop wakes up without delay.
+  CHECK(write(sv[0][1], "x", 1) == 1);
+  CHECK(test_dispatch(L, 50) == 1);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.batch_delays == 0);
+
+  // but after a poll with fewer events than the batch it waits for more.
+  for (i = 0; i < 4; i++)
+    CHECK(write(sv[i][1], "x", 1) == 1);
+  CHECK(test_dispatch(L, 50) == 4);
+  CHECK(loop_stats(L, &s) == 0);
+  CHECK(s.batch_delays == 1 && s.batch_hits == 1);
+  CHECK(hist_sum(s.delay_ns) == 1 && s.delay_ns[0] == 0);
+  for (i = 0; i < 4; i++) {
+    CHECK(p[i].calls == 1 + !i);
+    loop_del(L, &p[i].ev);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+  loop_free(L);
+}
+
+// test_setopt checks that loop_setopt rejects an unknown option.
+static void test_setopt(void) {
+  struct loop *L;
+
+  CHECK((L = loop_alloc(4)) != NULL);
+  CHECK(loop_setopt(L, 0, 1) < 0);
+  CHECK(loop_setopt(L, 1000, 1) < 0);
+  loop_free(L);
+}
+
+int main(void) {
+  const char *backend;
+  struct loop *L;
+
+  if (!(L = loop_alloc(1))) {
+    perror("loop_alloc");
+    return 1;
+  }
+  backend = loop_backend(L);
+  loop_free(L);
+  test_stats();
+  test_busy_poll();
+  test_slack();
+  test_batch();
+  test_setopt();
+  return test_done("stats", backend);
+}
@@ -0,0 +1,121 @@
+// Tests of loop_submit, which only io_uring supports.
+
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "test.h"
+
+// struct op is a request counting its completions.
+struct op {
+  struct ev_req req;
+  int done;
+};
+
+static int op_cb(struct loop *L, struct ev_req *req) {
+  struct op *op = container_of(req, struct op, req);
+  op->done++;
+  return 0;
+}
+
+static void op_init(struct op *op, int code, int fd, void *buf, unsigned len) {
+  memset(op, 0, sizeof(*op));
+  op->req.op = code;
+  op->req.fd = fd;
+  op->req.buf = buf;
+  op->req.len = len;
+  op->req.callback = op_cb;
+}
+
+// wait_done dispatches until the requests are completed, or gives up.
+static void wait_done(struct loop *L, struct op *a, struct op *b) {
+  int i;
+  for (i = 0; i < 50 && !(a->done && (!b || b->done)); i++)
+    test_dispatch(L, 100);
+  CHECK(a->done == 1);
+  CHECK(!b || b->done == 1);
+}
+
+// test_rw writes to one end of a socket pair and reads from the other.
+static void test_rw(struct loop *L) {
+  struct op w, r;
+  char buf[16] = {0};
+  int sv[2];
+
+  test_pair(sv);
+  op_init(&w, EV_OP_WRITE, sv[0], "hello", 5);
+  op_init(&r, EV_OP_READ, sv[1], buf, sizeof(buf));
+  CHECK(loop_submit(L, &w.req) == 0);
+  CHECK(loop_submit(L, &r.req) == 0);
+  wait_done(L, &w, &r);
+  CHECK(w.req.res == 5);
+  CHECK(r.req.res == 5 && !memcmp(buf, "hello", 5));
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_accept_connect connects to a listener on the loopback.
+static void test_accept_connect(struct loop *L) {
+  struct sockaddr_in addr = {0}, peer;
+  socklen_t len = sizeof(addr);
+  struct op a, c;
+  int lfd, cfd;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  cfd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(lfd >= 0 && cfd >= 0);
+  CHECK(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  CHECK(listen(lfd, 8) == 0);
+  CHECK(getsockname(lfd, (struct sockaddr *)&addr, &len) == 0);
+  op_init(&a, EV_OP_ACCEPT, lfd, &peer, sizeof(peer));
+  op_init(&c, EV_OP_CONNECT, cfd, &addr, sizeof(addr));
+  CHECK(loop_submit(L, &a.req) == 0);
+  CHECK(loop_submit(L, &c.req) == 0);
+  wait_done(L, &a, &c);
+  CHECK(a.req.res >= 0);
+  CHECK(c.req.res == 0);
+  CHECK(a.req.len == sizeof(peer) && peer.sin_family == AF_INET);
+  if (a.req.res >= 0)
+    close(a.req.res);
+  close(cfd);
+  close(lfd);
+}
+
+// test_unsupported checks that the other backends refuse requests.
+static void test_unsupported(int backend) {
+  struct loop *L;
+  struct op w;
+  int sv[2];
+
+  if (!(L = loop_alloc_flags(4, backend)))  // not built in.
+    return;
+  test_pair(sv);
+  op_init(&w, EV_OP_WRITE, sv[0], "x", 1);
+  errno = 0;
+  CHECK(loop_submit(L, &w.req) < 0 && errno == ENOSYS);
+  test_dispatch(L, 10);
+  CHECK(w.done == 0);
+  loop_free(L);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(void) {
+  const char *backend = "none";
+  struct loop *L;
+
+  test_unsupported(LOOP_EPOLL);
+  test_unsupported(LOOP_KQUEUE);
+  test_unsupported(LOOP_POLL);
+  test_unsupported(LOOP_SELECT);
+  if ((L = loop_alloc_flags(4, LOOP_URING)) != NULL) {
+    backend = "uring";
+    test_rw(L);
+    test_accept_connect(L);
+    loop_free(L);
+  } else {
+    printf("submit: io_uring unavailable, completions not tested\n");
+  }
+  return test_done("submit", backend);
+}
@@ -0,0 +1,81 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+// A tiny harness shared by the tests. A test is a program which runs its
+// cases and exits non-zero if a CHECK failed, on the backend picked by
+// $LIBX_BACKEND unless it asks for one, e.g.
+//
+//   LIBX_BACKEND=poll make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "x/ev.h"
+#include "x/mm.h"
+
+static int test_failures;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__,    \
+              __func__, #cond);                                               \
+      test_failures++;                                                        \
+    }                                                                         \
+  } while (0)
+
+// struct probe is an IO event counting its callbacks, which reads a byte
+// if 'drain' is set.
+struct probe {
+  struct ev ev;
+  int calls;
+  int drain;
+};
+
+static int probe_cb(struct loop *L, struct ev *ev) {
+  struct probe *p = container_of(ev, struct probe, ev);
+  char c;
+  p->calls++;
+  if (p->drain && read(ev->fd, &c, 1) != 1)
+    return -1;
+  return 0;
+}
+
+static inline void probe_init(struct probe *p, int fd, int events) {
+  p->ev = (struct ev){.fd = fd, .events = events, .callback = probe_cb};
+  p->calls = 0;
+  p->drain = 0;
+}
+
+static inline void test_pair(int sv[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+}
+
+static int test_timeout(struct loop *L, struct ev *ev) { return 0; }
+
+// test_dispatch calls loop_dispatch once, but no longer than 'ms', so
+// that a test checking nothing fires doesn't block forever.
+static inline int test_dispatch(struct loop *L, int ms) {
+  struct ev t = {.fd = -1, .events = EV_TIMER, .ms = ms};
+  int n;
+  t.callback = test_timeout;
+  loop_add(L, &t);
+  n = loop_dispatch(L, EV_ALL);
+  loop_del(L, &t);
+  return n;
+}
+
+// test_done reports the result of a test on a backend and returns its
+// exit status.
+static inline int test_done(const char *name, const char *backend) {
+  printf("%s (%s): %s\n", name, backend, test_failures ? "FAIL" : "ok");
+  return test_failures != 0;
+}
+
+#endif  // _TEST_H
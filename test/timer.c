@@ -0,0 +1,200 @@
+// Tests of timer events, and of IO events with a timeout.
+
+#include "test.h"
+
+struct beat {
+  struct ev ev;
+  int ticks;
+  int reads;
+};
+
+static int on_beat(struct loop *L, struct ev *ev) {
+  struct beat *b = container_of(ev, struct beat, ev);
+  char c;
+  if (ev->revents & EV_TIMER)
+    b->ticks++;
+  if ((ev->revents & EV_READ) && read(ev->fd, &c, 1) == 1)
+    b->reads++;
+  return 0;
+}
+
+// test_persist_io checks that an IO event with an EV_PERSIST timeout, like
+// a heartbeat of a connection, keeps watching its fd after it ticks.
+static void test_persist_io(struct loop *L) {
+  struct beat b = {0};
+  int sv[2], i, written = 0;
+
+  test_pair(sv);
+  b.ev.fd = sv[0];
+  b.ev.events = EV_READ | EV_TIMER | EV_PERSIST;
+  b.ev.ms = 20;
+  b.ev.callback = on_beat;
+  CHECK(loop_add(L, &b.ev) == 0);
+  // a dispatch may return without firing anything, e.g. on io_uring.
+  for (i = 0; i < 100 && b.ticks < 6; i++) {
+    if (b.ticks == 2 && !written++)
+      CHECK(write(sv[1], "x", 1) == 1);
+    loop_dispatch(L, EV_ALL);
+  }
+  CHECK(b.reads == 1);
+  CHECK(b.ticks == 6);
+  loop_del(L, &b.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// test_once_io checks that an IO event stops watching its fd once its
+// timeout fires, unless it is EV_PERSIST.
+static void test_once_io(struct loop *L) {
+  struct beat b = {0};
+  int sv[2], i;
+
+  test_pair(sv);
+  b.ev.fd = sv[0];
+  b.ev.events = EV_READ | EV_TIMER;
+  b.ev.ms = 10;
+  b.ev.callback = on_beat;
+  CHECK(loop_add(L, &b.ev) == 0);
+  for (i = 0; i < 100 && !b.ticks; i++)
+    loop_dispatch(L, EV_ALL);
+  CHECK(b.ticks == 1);
+  CHECK(write(sv[1], "x", 1) == 1);
+  test_dispatch(L, 30);
+  CHECK(b.reads == 0);
+  loop_del(L, &b.ev);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+struct closer {
+  struct ev ev;
+  struct tq *tq;
+  int *calls;
+};
+
+static int on_close(struct loop *L, struct ev *ev) {
+  struct closer *c = container_of(ev, struct closer, ev);
+  (*c->calls)++;
+  tq_free(c->tq);
+  return 0;
+}
+
+// test_tq_free checks that a callback can free its own timeout queue,
+// and that the rest of the events of the queue never time out.
+static void test_tq_free(struct loop *L) {
+  struct closer c[3];
+  struct tq *tq;
+  int i, calls = 0;
+
+  CHECK((tq = tq_alloc(L, 10)) != NULL);
+  memset(c, 0, sizeof(c));
+  for (i = 0; i < 3; i++) {
+    c[i].ev.fd = -1;
+    c[i].ev.callback = on_close;
+    c[i].tq = tq;
+    c[i].calls = &calls;
+    CHECK(tq_add(tq, &c[i].ev) == 0);
+  }
+  for (i = 0; i < 100 && !calls; i++)
+    loop_dispatch(L, EV_ALL);
+  CHECK(calls == 1);
+  test_dispatch(L, 30);
+  CHECK(calls == 1);
+}
+
+// struct tick counts the calls of a standalone timer, which calls
+// timer_again on its own handle 'again' times.
+struct tick {
+  long long id;
+  int calls;
+  int again;
+};
+
+static int on_tick(struct loop *L, void *arg) {
+  struct tick *t = arg;
+  t->calls++;
+  if (t->again > 0) {
+    t->again--;
+    CHECK(timer_again(L, t->id) == 0);
+  }
+  return 0;
+}
+
+// test_handles checks that the handle of a timer stopped or fired is
+// refused, even once its slot is taken by another timer.
+static void test_handles(struct loop *L) {
+  struct tick a = {0}, b = {0};
+  long long stale;
+  int i;
+
+  CHECK((a.id = timer_start(L, 10, 0, on_tick, &a)) > 0);
+  CHECK(timer_stop(L, a.id) == 0);
+  CHECK(timer_stop(L, a.id) < 0);
+  stale = a.id;
+  CHECK((b.id = timer_start(L, 10, 0, on_tick, &b)) > 0);
+  CHECK(b.id != stale);
+  CHECK(timer_stop(L, stale) < 0);
+  CHECK(timer_again(L, stale) < 0);
+  for (i = 0; i < 100 && !b.calls; i++)
+    loop_dispatch(L, EV_ALL);
+  CHECK(a.calls == 0 && b.calls == 1);
+  CHECK(timer_stop(L, b.id) < 0);  // fired
+  CHECK(timer_again(L, b.id) < 0);
+  CHECK(timer_start(L, 0, 0, on_tick, &a) < 0);
+}
+
+// test_again checks that timer_again pushes back the deadline of a timer,
+// and that a timer which doesn't repeat fires again if its function
+// calls timer_again.
+static void test_again(struct loop *L) {
+  struct tick a = {0}, b = {0};
+  long long start;
+  int i;
+
+  CHECK((a.id = timer_start(L, 60, 0, on_tick, &a)) > 0);
+  start = loop_now(L);
+  while (loop_now(L) - start < 30000000LL)  // 30ms
+    test_dispatch(L, 5);
+  CHECK(timer_again(L, a.id) == 0);  // due 60ms from now.
+  while (loop_now(L) - start < 75000000LL)  // past the first deadline.
+    test_dispatch(L, 5);
+  CHECK(a.calls == 0);
+  for (i = 0; i < 100 && !a.calls; i++)
+    loop_dispatch(L, EV_ALL);
+  CHECK(a.calls == 1);
+
+  b.again = 2;
+  CHECK((b.id = timer_start(L, 5, 0, on_tick, &b)) > 0);
+  for (i = 0; i < 100 && b.calls < 3; i++)
+    loop_dispatch(L, EV_ALL);
+  CHECK(b.calls == 3);
+  test_dispatch(L, 20);
+  CHECK(b.calls == 3);
+  CHECK(timer_stop(L, b.id) < 0);
+}
+
+// test_all runs the tests on a loop with the given flags, which pick the
+// minheap or the timing wheel.
+static void test_all(int flags, const char **backend) {
+  struct loop *L;
+
+  if (!(L = loop_alloc_flags(4, flags))) {
+    perror("loop_alloc_flags");
+    exit(1);
+  }
+  *backend = loop_backend(L);
+  test_persist_io(L);
+  test_once_io(L);
+  test_tq_free(L);
+  test_handles(L);
+  test_again(L);
+  loop_free(L);
+}
+
+int main(void) {
+  const char *backend;
+
+  test_all(0, &backend);
+  test_all(LOOP_WHEEL, &backend);
+  return test_done("timer", backend);
+}